@@ -0,0 +1,8 @@
+/* vtunerc tools: see linux/kernel.h */
+
+#ifndef _VTUNERC_SHIM_STRING_H
+#define _VTUNERC_SHIM_STRING_H
+
+#include <string.h>
+
+#endif
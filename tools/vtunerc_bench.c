@@ -0,0 +1,476 @@
+/*
+ * vtunerc_bench: loopback benchmark of the vtunerc driver
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Needs only the loaded module, no tuner and no network:
+ *  - stub daemon: answers every request of the driver locally
+ *  - generator:   writes synthetic TS of a given PID mix and rate
+ *                 into the control device, every packet carries
+ *                 its send time
+ *  - reader:      filters the PIDs on demux0 and reads dvr0,
+ *                 measuring packet latency and continuity
+ *  - main thread: FE_READ_STATUS round trips through the daemon,
+ *                 optionally feed start/stop churn first (-z)
+ *
+ * Example: vtunerc_bench -t 10 -r 200 -p 0x100:70,0x101:20,0x1fff:10
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+
+#include "vtunerc_tools.h"
+
+#define MAX_PIDS	32
+#define HIST_BUCKETS	32	/* log2 of microseconds */
+
+struct pidmix {
+	u16 pid;
+	unsigned int weight;
+	u8 cc;
+};
+
+struct hist {
+	u64 count;
+	u64 sum_ns;
+	u64 max_ns;
+	u64 bucket[HIST_BUCKETS];
+};
+
+static struct pidmix mix[MAX_PIDS];
+static int nmix;
+static unsigned int mix_total;
+
+static const char *ctrldev = "/dev/vtunerc0";
+static int adapter;
+static double rate_mbit = 100;
+static int batch = 348;		/* packets per write(), 64 KiB */
+static int seconds = 10;
+static int zaps;
+
+static int ctrl;
+static volatile int running = 1;
+
+static u64 gen_bytes, gen_writes;
+static u64 rd_bytes, rd_packets, rd_cc_errors;
+static u64 requests;
+static struct hist pkt_lat, ctl_lat;
+
+static void hist_add(struct hist *h, u64 ns)
+{
+	int b = 0;
+	u64 us = ns / 1000;
+
+	while (us && b < HIST_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+	h->bucket[b]++;
+	h->count++;
+	h->sum_ns += ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+}
+
+/* upper bound of the bucket holding the given fraction, in us */
+static u64 hist_pct(const struct hist *h, double pct)
+{
+	u64 n = 0, want = h->count * pct;
+	int b;
+
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		n += h->bucket[b];
+		if (n > want)
+			break;
+	}
+	return 1ULL << b;
+}
+
+static void hist_print(const char *name, const struct hist *h)
+{
+	if (!h->count) {
+		printf("%-13s: no samples\n", name);
+		return;
+	}
+	printf("%-13s: %llu samples, avg %.1f us, p50 <%llu us, p99 <%llu us, max %.1f us\n",
+		name, (unsigned long long)h->count,
+		h->sum_ns / 1e3 / h->count,
+		(unsigned long long)hist_pct(h, 0.50),
+		(unsigned long long)hist_pct(h, 0.99),
+		h->max_ns / 1e3);
+}
+
+static void parse_mix(char *s)
+{
+	char *tok, *colon;
+
+	nmix = 0;
+	mix_total = 0;
+	for (tok = strtok(s, ","); tok && nmix < MAX_PIDS;
+			tok = strtok(NULL, ",")) {
+		mix[nmix].pid = strtoul(tok, &colon, 0) & 0x1fff;
+		mix[nmix].weight = *colon == ':' ? atoi(colon + 1) : 1;
+		mix_total += mix[nmix].weight;
+		nmix++;
+	}
+}
+
+/* weighted round robin, deterministic */
+static struct pidmix *next_pid(void)
+{
+	static unsigned int pos;
+	unsigned int w = pos++ % mix_total;
+	int i;
+
+	for (i = 0; i < nmix; i++) {
+		if (w < mix[i].weight)
+			return &mix[i];
+		w -= mix[i].weight;
+	}
+	return &mix[0];
+}
+
+static void *daemon_thread(void *arg)
+{
+	struct vtuner_message msg;
+	struct pollfd pfd;
+
+	pfd.fd = ctrl;
+	pfd.events = POLLPRI;
+
+	while (running) {
+		if (poll(&pfd, 1, 100) <= 0 || !(pfd.revents & POLLPRI))
+			continue;
+		if (ioctl(ctrl, VTUNER_GET_MESSAGE, &msg))
+			continue;
+		requests++;
+
+		switch (msg.type) {
+		case MSG_PIDLIST:
+			continue;
+		case MSG_READ_STATUS:
+			msg.body.status = FE_HAS_SIGNAL | FE_HAS_CARRIER |
+				FE_HAS_VITERBI | FE_HAS_SYNC | FE_HAS_LOCK;
+			break;
+		default:
+			break;
+		}
+		ioctl(ctrl, VTUNER_SET_RESPONSE, &msg);
+	}
+
+	return NULL;
+}
+
+static void *gen_thread(void *arg)
+{
+	size_t len = batch * 188;
+	u8 *buf = malloc(len), *p;
+	u64 t, next, interval = 0;
+	struct pidmix *m;
+	ssize_t n;
+	int i;
+
+	if (rate_mbit > 0)
+		interval = len * 8 * 1000 / rate_mbit;	/* ns per batch */
+
+	memset(buf, 0xff, len);
+	next = now_ns();
+
+	while (running) {
+		t = now_ns();
+		for (i = 0, p = buf; i < batch; i++, p += 188) {
+			m = next_pid();
+			p[0] = 0x47;
+			p[1] = m->pid >> 8;
+			p[2] = m->pid & 0xff;
+			p[3] = 0x10 | (m->cc++ & 0x0f);
+			memcpy(p + 4, &t, sizeof(t));
+		}
+
+		n = write(ctrl, buf, len);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			perror("write");
+			break;
+		}
+		gen_bytes += n;
+		gen_writes++;
+
+		if (interval) {
+			next += interval;
+			sleep_until_ns(next);
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void *reader_thread(void *arg)
+{
+	static u8 buf[188 * 1024];
+	u8 cc[0x2000];
+	u8 seen[0x2000];
+	char path[64];
+	u64 t, now;
+	ssize_t n, i;
+	u16 pid;
+	int dvr;
+
+	memset(seen, 0, sizeof(seen));
+
+	snprintf(path, sizeof(path), "/dev/dvb/adapter%d/dvr0", adapter);
+	dvr = open(path, O_RDONLY);
+	if (dvr < 0) {
+		perror(path);
+		return NULL;
+	}
+	ioctl(dvr, DMX_SET_BUFFER_SIZE, 4 * 1024 * 1024);
+
+	while (running) {
+		n = read(dvr, buf, sizeof(buf));
+		if (n <= 0) {
+			if (n < 0 && errno != EINTR && errno != EOVERFLOW)
+				break;
+			continue;
+		}
+		now = now_ns();
+		rd_bytes += n;
+
+		for (i = 0; i + 188 <= n; i += 188) {
+			pid = ((buf[i + 1] & 0x1f) << 8) | buf[i + 2];
+			if (seen[pid] && (buf[i + 3] & 0x0f) != ((cc[pid] + 1) & 0x0f))
+				rd_cc_errors++;
+			cc[pid] = buf[i + 3] & 0x0f;
+			seen[pid] = 1;
+
+			memcpy(&t, buf + i + 4, sizeof(t));
+			hist_add(&pkt_lat, now - t);
+			rd_packets++;
+		}
+	}
+
+	close(dvr);
+	return NULL;
+}
+
+/* demux filters for all PIDs but the null one */
+static int open_filters(int *fds)
+{
+	struct dmx_pes_filter_params p;
+	char path[64];
+	int i, n = 0;
+
+	snprintf(path, sizeof(path), "/dev/dvb/adapter%d/demux0", adapter);
+	for (i = 0; i < nmix; i++) {
+		if (mix[i].pid == 0x1fff)
+			continue;
+		fds[n] = open(path, O_RDWR);
+		if (fds[n] < 0) {
+			perror(path);
+			exit(1);
+		}
+		memset(&p, 0, sizeof(p));
+		p.pid = mix[i].pid;
+		p.input = DMX_IN_FRONTEND;
+		p.output = DMX_OUT_TS_TAP;
+		p.pes_type = DMX_PES_OTHER;
+		p.flags = DMX_IMMEDIATE_START;
+		if (ioctl(fds[n], DMX_SET_PES_FILTER, &p)) {
+			perror("DMX_SET_PES_FILTER");
+			exit(1);
+		}
+		n++;
+	}
+
+	return n;
+}
+
+/* start and stop feeds on changing PIDs, as zapping clients do */
+static void zap_bench(int count)
+{
+	struct dmx_pes_filter_params p;
+	struct hist h;
+	char path[64];
+	int i, fd;
+	u64 t;
+
+	memset(&h, 0, sizeof(h));
+	snprintf(path, sizeof(path), "/dev/dvb/adapter%d/demux0", adapter);
+
+	for (i = 0; i < count; i++) {
+		fd = open(path, O_RDWR);
+		if (fd < 0) {
+			perror(path);
+			return;
+		}
+		memset(&p, 0, sizeof(p));
+		p.pid = 0x200 + i % 16;
+		p.input = DMX_IN_FRONTEND;
+		p.output = DMX_OUT_TS_TAP;
+		p.pes_type = DMX_PES_OTHER;
+		p.flags = DMX_IMMEDIATE_START;
+
+		t = now_ns();
+		if (ioctl(fd, DMX_SET_PES_FILTER, &p)) {
+			perror("DMX_SET_PES_FILTER");
+			close(fd);
+			return;
+		}
+		close(fd);
+		hist_add(&h, now_ns() - t);
+	}
+
+	hist_print("feed churn", &h);
+}
+
+static double cpu_seconds(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d ctrldev] [-a adapter] [-t seconds] [-r mbit] [-b packets] [-p pid:weight,...] [-z count]\n"
+		"  -d  control device (/dev/vtunerc0)\n"
+		"  -a  DVB adapter of that device (0)\n"
+		"  -t  duration in seconds (10)\n"
+		"  -r  TS rate in Mbit/s, 0 as fast as possible (100)\n"
+		"  -b  packets per write() (348)\n"
+		"  -p  PID mix (0x100:80,0x1fff:20)\n"
+		"  -z  start/stop that many feeds before the run (0)\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char defmix[] = "0x100:80,0x1fff:20";
+	pthread_t daemon, gen, reader;
+	int fds[MAX_PIDS], nfds, i, c, fe;
+	char path[64];
+	double cpu, secs, gbit;
+	fe_status_t status;
+	u64 start, t;
+
+	parse_mix(defmix);
+
+	while ((c = getopt(argc, argv, "d:a:t:r:b:p:z:")) != -1) {
+		switch (c) {
+		case 'd':
+			ctrldev = optarg;
+			break;
+		case 'a':
+			adapter = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'r':
+			rate_mbit = atof(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'p':
+			parse_mix(optarg);
+			break;
+		case 'z':
+			zaps = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (batch < 1 || !nmix || !mix_total)
+		usage(argv[0]);
+
+	ctrl = open(ctrldev, O_RDWR);
+	if (ctrl < 0) {
+		perror(ctrldev);
+		return 1;
+	}
+	ioctl(ctrl, VTUNER_SET_NAME, "vtunerc_bench");
+	if (ioctl(ctrl, VTUNER_SET_TYPE, "DVB-S2"))
+		perror("VTUNER_SET_TYPE");
+
+	pthread_create(&daemon, NULL, daemon_thread, NULL);
+	pthread_create(&reader, NULL, reader_thread, NULL);
+	if (zaps)
+		zap_bench(zaps);
+	nfds = open_filters(fds);
+
+	snprintf(path, sizeof(path), "/dev/dvb/adapter%d/frontend0", adapter);
+	fe = open(path, O_RDONLY | O_NONBLOCK);
+	if (fe < 0)
+		perror(path);
+
+	cpu = cpu_seconds();
+	start = now_ns();
+	pthread_create(&gen, NULL, gen_thread, NULL);
+
+	/* control round trips while the TS flows */
+	while (now_ns() - start < seconds * 1000000000ULL) {
+		if (fe >= 0) {
+			t = now_ns();
+			if (ioctl(fe, FE_READ_STATUS, &status) == 0)
+				hist_add(&ctl_lat, now_ns() - t);
+		}
+		usleep(10000);
+	}
+
+	running = 0;
+	pthread_join(gen, NULL);
+	secs = (now_ns() - start) / 1e9;
+	cpu = cpu_seconds() - cpu;
+
+	/* the reader may sit in read() of a now idle dvr0 */
+	pthread_cancel(reader);
+	pthread_join(reader, NULL);
+	pthread_join(daemon, NULL);
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+	if (fe >= 0)
+		close(fe);
+	close(ctrl);
+
+	gbit = gen_bytes * 8 / 1e9;
+	printf("duration     : %.2f s\n", secs);
+	printf("written      : %llu bytes in %llu writes, %.1f Mbit/s\n",
+		(unsigned long long)gen_bytes, (unsigned long long)gen_writes,
+		gbit * 1000 / secs);
+	printf("read dvr0    : %llu bytes, %llu packets, %llu CC errors\n",
+		(unsigned long long)rd_bytes, (unsigned long long)rd_packets,
+		(unsigned long long)rd_cc_errors);
+	printf("CPU          : %.2f s (user+sys of all threads), %.2f s per Gbit\n",
+		cpu, gbit > 0 ? cpu / gbit : 0);
+	printf("requests     : %llu answered by the stub daemon\n",
+		(unsigned long long)requests);
+	hist_print("packet lat.", &pkt_lat);
+	hist_print("control RTT", &ctl_lat);
+
+	return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * vtunerc tools: libFuzzer entry point and a plain driver for it
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _VTUNERC_FUZZ_H_
+#define _VTUNERC_FUZZ_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+#ifdef VTUNERC_FUZZ_MAIN
+/*
+ * without libFuzzer: run the inputs named on the command line once,
+ * e.g. to replay a crash or a corpus with a compiler lacking
+ * -fsanitize=fuzzer
+ */
+int main(int argc, char **argv)
+{
+	static uint8_t buf[1 << 20];
+	size_t n;
+	FILE *f;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		f = fopen(argv[i], "rb");
+		if (!f) {
+			perror(argv[i]);
+			return 1;
+		}
+		n = fread(buf, 1, sizeof(buf), f);
+		fclose(f);
+		LLVMFuzzerTestOneInput(buf, n);
+	}
+	printf("%d inputs ok\n", argc - 1);
+
+	return 0;
+}
+#endif
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * vtunerc_fuzz_proto: fuzz the framed message decoder
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * The input is what a daemon hands to VTUNER_SET_RESPONSE_FRAMED.
+ * Anything the decoder accepts has to stay within the input and come
+ * back unchanged through encode and decode.
+ */
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/errno.h>
+
+#include "vtunerc_proto.h"
+#include "vtunerc_fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	struct vtuner_message msg, msg2;
+	u8 rec[VTUNER_MSG_MAXREC];
+	u32 seq, seq2;
+	u16 flags, flags2;
+	int len, len2;
+
+	len = vtunerc_proto_decode(data, size, &msg, &seq, &flags);
+	if (len < 0)
+		return 0;
+	if (len < (int)sizeof(struct vtuner_msg_hdr) || (size_t)len > size)
+		abort();
+
+	len2 = vtunerc_proto_encode(&msg, seq, flags, rec, sizeof(rec));
+	if (len2 < 0 || len2 > (int)sizeof(rec) ||
+			len2 % VTUNER_MSG_ALIGN)
+		abort();
+
+	/* too small a buffer is refused, not overrun */
+	if (vtunerc_proto_encode(&msg, seq, flags, rec, len2 - 1) != -EMSGSIZE)
+		abort();
+
+	if (vtunerc_proto_decode(rec, len2, &msg2, &seq2, &flags2) != len2)
+		abort();
+	if (msg2.type != msg.type || seq2 != seq || flags2 != flags ||
+			memcmp(&msg.body, &msg2.body,
+				vtunerc_proto_body_len(msg.type)))
+		abort();
+
+	return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * vtunerc_fuzz_ts: fuzz TS alignment and packet validation
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * The first input byte picks the piece size the stream is cut into,
+ * as pinned pages of a write() would be, the rest is the stream.
+ * Checked: the aligned output is exactly the input cut into whole
+ * packets, the batch test agrees with a per packet test and
+ * vtunerc_ts_check() drops exactly the broken packets.
+ */
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+
+#include "vtunerc_ts.h"
+#include "vtunerc_fuzz.h"
+
+static struct vtunerc_pidstat pidstat[0x2000];
+
+struct out {
+	const u8 *stream;
+	size_t done;
+};
+
+static int check_batch(void *arg, const u8 *buf, size_t len)
+{
+	struct out *out = arg;
+	struct vtunerc_ts_stats st;
+	size_t count = len / 188, i;
+	int bad = 0, suspect, broken;
+	const u8 *p;
+
+	if (!len || len % 188 || memcmp(buf, out->stream + out->done, len))
+		abort();
+	out->done += len;
+
+	for (i = 0, p = buf; i < count; i++, p += 188)
+		bad |= p[0] != 0x47 || (p[1] & 0x80);
+
+	suspect = vtunerc_ts_batch_bad(buf, count) != 0;
+	if (suspect != bad)
+		abort();
+
+	memset(&st, 0, sizeof(st));
+	for (i = 0, p = buf; i < count; i++, p += 188) {
+		broken = p[0] != 0x47 || (p[1] & 0x80);
+		if (vtunerc_ts_check(pidstat, p, suspect, &st) != !broken)
+			abort();
+	}
+	if (st.drop_sync + st.drop_tei > count || st.cc_errors > count)
+		abort();
+
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	u8 trail[188];
+	unsigned int trailsize = 0;
+	struct out out;
+	size_t piece, n;
+
+	if (!size)
+		return 0;
+
+	piece = (size_t)data[0] * 17 + 1;
+	data++;
+	size--;
+
+	out.stream = data;
+	out.done = 0;
+	for (n = 0; n < size; n += piece)
+		vtunerc_ts_align(trail, &trailsize, data + n,
+				min_t(size_t, piece, size - n), check_batch, &out);
+
+	if (out.done != size - size % 188 || trailsize != size % 188 ||
+			memcmp(trail, data + out.done, trailsize))
+		abort();
+
+	return 0;
+}
@@ -0,0 +1,235 @@
+/*
+ * vtunerc_microbench: time the shared per packet and message code
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Runs vtunerc_ts.c and vtunerc_proto.c as built for the module, but
+ * in userspace, so perf and a quick edit/compile loop can be used.
+ * Each case repeats with growing iteration counts until it ran for
+ * the minimum time, then reports wall and CPU time per iteration and
+ * the byte rate, in the manner of google-benchmark:
+ *
+ *   ./vtunerc_microbench [-t min_seconds] [filter]
+ */
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vtunerc_ts.h"
+#include "vtunerc_proto.h"
+
+#define BATCH	348	/* packets in a 64 KiB write */
+
+struct bench {
+	const char *name;
+	void (*fn)(u64 iters, long arg);
+	long arg;
+	size_t bytes;	/* per iteration, 0 no rate */
+};
+
+static u8 ts[BATCH * 188];
+static u8 ts_bad[BATCH * 188];
+static struct vtunerc_pidstat pidstat[0x2000];
+static volatile u64 sink;
+
+static u64 clock_ns(clockid_t clk)
+{
+	struct timespec t;
+
+	clock_gettime(clk, &t);
+	return (u64)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/* a few PIDs with proper continuity counters, like a real mux */
+static void make_ts(void)
+{
+	static const u16 pids[] = { 0x100, 0x101, 0x102, 0x1fff };
+	u8 cc[4] = { 0 };
+	u8 *p;
+	int i, k;
+
+	for (i = 0, p = ts; i < BATCH; i++, p += 188) {
+		k = i % 7 == 6 ? 3 : i % 3;
+		memset(p, 0xff, 188);
+		p[0] = 0x47;
+		p[1] = pids[k] >> 8;
+		p[2] = pids[k] & 0xff;
+		p[3] = 0x10 | (cc[k]++ & 0x0f);
+	}
+
+	/* one broken packet spoils the whole batch test */
+	memcpy(ts_bad, ts, sizeof(ts));
+	ts_bad[(BATCH / 2) * 188 + 1] |= 0x80;
+}
+
+static void bm_batch_bad(u64 iters, long count)
+{
+	u64 i;
+
+	for (i = 0; i < iters; i++)
+		sink += vtunerc_ts_batch_bad(ts, count);
+}
+
+static void bm_check(u64 iters, long suspect)
+{
+	struct vtunerc_ts_stats st;
+	const u8 *buf = suspect ? ts_bad : ts;
+	u64 i;
+	int k;
+
+	memset(&st, 0, sizeof(st));
+	for (i = 0; i < iters; i++)
+		for (k = 0; k < BATCH; k++)
+			sink += vtunerc_ts_check(pidstat, buf + k * 188,
+							suspect, &st);
+}
+
+static int noop(void *arg, const u8 *buf, size_t len)
+{
+	sink += len;
+	return 0;
+}
+
+/* the write in pieces of the given size, as pinned pages come */
+static void bm_align(u64 iters, long piece)
+{
+	u8 trail[188];
+	unsigned int trailsize = 0;
+	size_t n;
+	u64 i;
+
+	for (i = 0; i < iters; i++)
+		for (n = 0; n < sizeof(ts); n += piece)
+			vtunerc_ts_align(trail, &trailsize, ts + n,
+				min_t(size_t, piece, sizeof(ts) - n),
+				noop, NULL);
+}
+
+static void bm_strip(u64 iters, long pktsize)
+{
+	static u8 buf[BATCH * 204];
+	u64 i;
+
+	for (i = 0; i < iters; i++)
+		vtunerc_ts_strip(buf, BATCH, pktsize);
+	sink += buf[0];
+}
+
+static void bm_encode(u64 iters, long type)
+{
+	struct vtuner_message msg;
+	u8 rec[VTUNER_MSG_MAXREC];
+	u64 i;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = type;
+	for (i = 0; i < iters; i++)
+		sink += vtunerc_proto_encode(&msg, i, VTUNER_MSGF_RESPONSE,
+						rec, sizeof(rec));
+}
+
+static void bm_decode(u64 iters, long type)
+{
+	struct vtuner_message msg;
+	u8 rec[VTUNER_MSG_MAXREC];
+	u32 seq;
+	u16 flags;
+	int len;
+	u64 i;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = type;
+	len = vtunerc_proto_encode(&msg, 1, 0, rec, sizeof(rec));
+	for (i = 0; i < iters; i++)
+		sink += vtunerc_proto_decode(rec, len, &msg, &seq, &flags);
+}
+
+static struct bench benches[] = {
+	{ "ts_batch_bad/7",		bm_batch_bad, 7,	7 * 188 },
+	{ "ts_batch_bad/348",		bm_batch_bad, BATCH,	BATCH * 188 },
+	{ "ts_check/clean",		bm_check, 0,		BATCH * 188 },
+	{ "ts_check/suspect",		bm_check, 1,		BATCH * 188 },
+	{ "ts_align/188",		bm_align, 188,		BATCH * 188 },
+	{ "ts_align/4096",		bm_align, 4096,		BATCH * 188 },
+	{ "ts_align/65424",		bm_align, BATCH * 188,	BATCH * 188 },
+	{ "ts_strip/192",		bm_strip, 192,		BATCH * 192 },
+	{ "ts_strip/204",		bm_strip, 204,		BATCH * 204 },
+	{ "proto_encode/READ_STATUS",	bm_encode, MSG_READ_STATUS,	0 },
+	{ "proto_encode/SET_FRONTEND",	bm_encode, MSG_SET_FRONTEND,	0 },
+	{ "proto_encode/PIDLIST",	bm_encode, MSG_PIDLIST,		0 },
+	{ "proto_decode/READ_STATUS",	bm_decode, MSG_READ_STATUS,	0 },
+	{ "proto_decode/SET_FRONTEND",	bm_decode, MSG_SET_FRONTEND,	0 },
+	{ "proto_decode/PIDLIST",	bm_decode, MSG_PIDLIST,		0 },
+};
+
+static void run(const struct bench *b, double min_time)
+{
+	u64 iters = 1, t, cpu;
+
+	for (;;) {
+		t = clock_ns(CLOCK_MONOTONIC);
+		cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+		b->fn(iters, b->arg);
+		cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+		t = clock_ns(CLOCK_MONOTONIC) - t;
+
+		if (t >= min_time * 1e9 || iters >= (1ULL << 40))
+			break;
+		/* aim a bit past the minimum, at most 10x per round */
+		if (t < min_time * 1e8)
+			iters *= 10;
+		else
+			iters = iters * min_time * 1.4e9 / t + 1;
+	}
+
+	printf("%-28s %10.1f ns %10.1f ns %12llu", b->name,
+			(double)t / iters, (double)cpu / iters,
+			(unsigned long long)iters);
+	if (b->bytes)
+		printf("  %8.1f MiB/s",
+			b->bytes * (double)iters / (t / 1e9) / 1048576);
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	double min_time = 0.5;
+	unsigned int i;
+	int c;
+
+	while ((c = getopt(argc, argv, "t:")) != -1) {
+		switch (c) {
+		case 't':
+			min_time = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t min_seconds] [filter]\n",
+					argv[0]);
+			return 1;
+		}
+	}
+
+	make_ts();
+
+	printf("%-28s %13s %13s %12s  %14s\n", "Benchmark", "Time", "CPU",
+			"Iterations", "Rate");
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+		if (optind >= argc || strstr(benches[i].name, argv[optind]))
+			run(&benches[i], min_time);
+
+	return 0;
+}
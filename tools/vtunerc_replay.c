@@ -0,0 +1,504 @@
+/*
+ * vtunerc_replay: play a vtunerc capture back against /dev/vtunercN
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Takes the place of the daemon: TS records are written to the
+ * control device at their original (or scaled) times, the records of
+ * one write() in one writev(), feed changes are reproduced by
+ * opening/closing filters on demux0, and requests of the driver are
+ * answered with the recorded responses of the same type. Requests are
+ * read framed, only those flagged VTUNER_MSGF_RESPONSE get an answer;
+ * a driver without the framed protocol gets the legacy ioctls, and
+ * answers to all but the types it never waits for.
+ * dvr0 and the filters are drained, so the whole path is loaded.
+ *
+ * Get the input with
+ *   echo 65536 > /sys/kernel/debug/vtunerc/vtunerc0/capture_kb
+ *   ... run the workload ...
+ *   cd /sys/kernel/debug/vtunerc/vtunerc0
+ *   for f in capture[0-9]*; do cat $f > /tmp/$f; done
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "vtunerc_tools.h"
+
+#define MAX_FILTERS	64
+#define MAX_IOV		64	/* records coalesced into one writev() */
+
+#define REC_ALIGN(len)	(((len) + VTUNER_MSG_ALIGN - 1) & ~(VTUNER_MSG_ALIGN - 1))
+
+struct rec {
+	struct vtuner_capture_rec hdr;
+	unsigned int order;
+	u8 *data;
+	int used;	/* RSP already handed out */
+};
+
+struct filter {
+	int fd;
+	u16 pid;
+	u16 feed_type;
+};
+
+static struct rec *recs;
+static unsigned int nrecs;
+
+static struct filter filters[MAX_FILTERS];
+static int nfilters;
+
+static int adapter;
+static int framed;
+
+static struct {
+	u64 ts_bytes;
+	u64 ts_calls;
+	u64 wr_ns_total;
+	u64 wr_ns_max;
+	u64 answered;
+	u64 replayed;
+	u64 dvr_bytes;
+	u64 sec_bytes;
+} st;
+
+static void load(const char *path)
+{
+	struct vtuner_capture_rec hdr;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+
+	while (fread(&hdr, sizeof(hdr), 1, f) == 1) {
+		if (hdr.magic != VTUNER_CAPTURE_MAGIC) {
+			fprintf(stderr, "%s: bad record magic at %ld\n", path,
+					ftell(f) - (long)sizeof(hdr));
+			exit(1);
+		}
+		recs = realloc(recs, (nrecs + 1) * sizeof(*recs));
+		recs[nrecs].hdr = hdr;
+		recs[nrecs].order = nrecs;
+		recs[nrecs].used = 0;
+		recs[nrecs].data = malloc(hdr.len);
+		if (!recs || !recs[nrecs].data ||
+				fread(recs[nrecs].data, hdr.len, 1, f) != 1) {
+			fprintf(stderr, "%s: truncated record\n", path);
+			exit(1);
+		}
+		nrecs++;
+	}
+
+	fclose(f);
+}
+
+static int rec_cmp(const void *a, const void *b)
+{
+	const struct rec *ra = a, *rb = b;
+
+	if (ra->hdr.time_ns != rb->hdr.time_ns)
+		return ra->hdr.time_ns < rb->hdr.time_ns ? -1 : 1;
+	return ra->order < rb->order ? -1 : 1;
+}
+
+/* the recorded response to the oldest unanswered request of that type */
+static struct rec *find_response(s32 type)
+{
+	unsigned int i, j;
+	struct vtuner_message *m;
+
+	for (i = 0; i < nrecs; i++) {
+		if (recs[i].hdr.type != VTUNER_CAPTURE_REQ || recs[i].used)
+			continue;
+		m = (struct vtuner_message *)recs[i].data;
+		if (m->type != type)
+			continue;
+		for (j = i + 1; j < nrecs; j++)
+			if (recs[j].hdr.type == VTUNER_CAPTURE_RSP &&
+					recs[j].hdr.call == recs[i].hdr.call) {
+				recs[i].used = 1;
+				return &recs[j];
+			}
+		recs[i].used = 1;
+	}
+
+	return NULL;
+}
+
+/* the recorded response, or the request itself when there is none */
+static void fill_response(struct vtuner_message *msg)
+{
+	struct rec *r;
+
+	r = find_response(msg->type);
+	if (r) {
+		memcpy(msg, r->data, sizeof(*msg));
+		st.replayed++;
+	}
+}
+
+/* ask for the framed protocol, which tells which requests wait */
+static void discover(int ctrl)
+{
+	struct vtuner_message msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = MSG_DISCOVER;
+	msg.body.discover.version = VTUNER_PROTO_VERSION;
+	msg.body.discover.caps = VTUNER_CAP_FRAMED;
+	if (ioctl(ctrl, VTUNER_DISCOVER, &msg) == 0)
+		framed = msg.body.discover.caps & VTUNER_CAP_FRAMED;
+}
+
+static void answer_framed(int ctrl)
+{
+	static u8 buf[16 * VTUNER_MSG_MAXREC];
+	u8 rsp[VTUNER_MSG_MAXREC];
+	struct vtuner_msg_hdr *hdr, *rhdr = (struct vtuner_msg_hdr *)rsp;
+	struct vtuner_message msg;
+	size_t off, reclen;
+	ssize_t n;
+
+	n = read(ctrl, buf, sizeof(buf));
+	for (off = 0; n > 0 && off + sizeof(*hdr) <= (size_t)n; off += reclen) {
+		hdr = (struct vtuner_msg_hdr *)(buf + off);
+		reclen = sizeof(*hdr) + REC_ALIGN(hdr->len);
+		if (hdr->len > sizeof(msg.body) || off + reclen > (size_t)n)
+			break;
+		if (!(hdr->flags & VTUNER_MSGF_RESPONSE))
+			continue;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.type = hdr->type;
+		memcpy(&msg.body, hdr + 1, hdr->len);
+		fill_response(&msg);
+
+		memset(rhdr, 0, sizeof(*rhdr));
+		rhdr->version = VTUNER_PROTO_VERSION;
+		rhdr->len = sizeof(msg.body);
+		rhdr->seq = hdr->seq;
+		rhdr->type = msg.type;
+		memcpy(rhdr + 1, &msg.body, sizeof(msg.body));
+		if (ioctl(ctrl, VTUNER_SET_RESPONSE_FRAMED, rsp) == 0)
+			st.answered++;
+	}
+}
+
+static void answer(int ctrl)
+{
+	struct vtuner_message msg;
+
+	if (framed) {
+		answer_framed(ctrl);
+		return;
+	}
+
+	if (ioctl(ctrl, VTUNER_GET_MESSAGE, &msg))
+		return;
+
+	/* notifications, the driver waits for no response */
+	if (msg.type == 0 || msg.type == MSG_PIDLIST ||
+			msg.type == MSG_SECFILTER)
+		return;
+
+	fill_response(&msg);
+
+	if (ioctl(ctrl, VTUNER_SET_RESPONSE, &msg) == 0)
+		st.answered++;
+}
+
+static void feed_start(const struct vtuner_capture_feed *feed)
+{
+	char path[64];
+	int fd, ret;
+
+	if (nfilters == MAX_FILTERS)
+		return;
+
+	snprintf(path, sizeof(path), "/dev/dvb/adapter%d/demux0", adapter);
+	fd = open(path, O_RDWR | O_NONBLOCK);
+	if (fd < 0) {
+		perror(path);
+		return;
+	}
+
+	if (feed->feed_type == VTUNER_FEED_SEC) {
+		struct dmx_sct_filter_params p;
+
+		memset(&p, 0, sizeof(p));
+		p.pid = feed->pid;
+		p.flags = DMX_IMMEDIATE_START;
+		ret = ioctl(fd, DMX_SET_FILTER, &p);
+	} else {
+		struct dmx_pes_filter_params p;
+
+		memset(&p, 0, sizeof(p));
+		p.pid = feed->pid;
+		p.input = DMX_IN_FRONTEND;
+		p.output = DMX_OUT_TS_TAP;
+		p.pes_type = DMX_PES_OTHER;
+		p.flags = DMX_IMMEDIATE_START;
+		ret = ioctl(fd, DMX_SET_PES_FILTER, &p);
+	}
+	if (ret) {
+		fprintf(stderr, "filter on pid 0x%x: %s\n", feed->pid,
+				strerror(errno));
+		close(fd);
+		return;
+	}
+
+	filters[nfilters].fd = fd;
+	filters[nfilters].pid = feed->pid;
+	filters[nfilters].feed_type = feed->feed_type;
+	nfilters++;
+}
+
+static void feed_stop(const struct vtuner_capture_feed *feed)
+{
+	int i;
+
+	for (i = nfilters - 1; i >= 0; i--)
+		if (filters[i].pid == feed->pid &&
+				filters[i].feed_type == feed->feed_type) {
+			close(filters[i].fd);
+			filters[i] = filters[--nfilters];
+			return;
+		}
+}
+
+/* the TS records of one original write(), in one writev() */
+static void write_ts(int ctrl, struct iovec *iov, int cnt)
+{
+	u64 t = now_ns();
+	ssize_t n;
+
+	while (cnt) {
+		n = writev(ctrl, iov, cnt);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			perror("writev");
+			exit(1);
+		}
+		st.ts_bytes += n;
+		/* short write: go on behind what was taken */
+		while (cnt && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base = (u8 *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	t = now_ns() - t;
+	st.ts_calls++;
+	st.wr_ns_total += t;
+	if (t > st.wr_ns_max)
+		st.wr_ns_max = t;
+}
+
+/* serve requests and drain outputs until deadline, 0 = just once */
+static void serve(int ctrl, int dvr, u64 deadline)
+{
+	static u8 buf[256 * 1024];
+	struct pollfd pfd[MAX_FILTERS + 2];
+	int i, n, timeout;
+	ssize_t r;
+	u64 now;
+
+	do {
+		pfd[0].fd = ctrl;
+		pfd[0].events = POLLPRI;
+		pfd[1].fd = dvr;
+		pfd[1].events = POLLIN;
+		for (i = 0; i < nfilters; i++) {
+			pfd[i + 2].fd = filters[i].fd;
+			pfd[i + 2].events = POLLIN;
+		}
+
+		now = now_ns();
+		timeout = 0;
+		if (deadline > now)
+			timeout = (deadline - now + 999999) / 1000000;
+
+		n = poll(pfd, nfilters + 2, timeout);
+		if (n <= 0)
+			continue;
+
+		if (pfd[0].revents & POLLPRI)
+			answer(ctrl);
+		if (pfd[1].revents & POLLIN) {
+			r = read(dvr, buf, sizeof(buf));
+			if (r > 0)
+				st.dvr_bytes += r;
+		}
+		for (i = 0; i < nfilters; i++)
+			if (pfd[i + 2].revents & POLLIN) {
+				r = read(pfd[i + 2].fd, buf, sizeof(buf));
+				if (r > 0)
+					st.sec_bytes += r;
+			}
+	} while (now_ns() < deadline);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d ctrldev] [-a adapter] [-s speed] [-t type] capture...\n"
+		"  -d  control device (/dev/vtunerc0)\n"
+		"  -a  DVB adapter of that device (0)\n"
+		"  -s  speed factor, 1 original timing, 0 as fast as possible (1)\n"
+		"  -t  register frontend type DVB-S, DVB-S2, DVB-C or DVB-T\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *ctrldev = "/dev/vtunerc0", *type = NULL;
+	double speed = 1.0;
+	char path[64];
+	struct iovec iov[MAX_IOV];
+	u64 t0, start, due, elapsed;
+	unsigned int i;
+	int c, ctrl, dvr, cnt;
+
+	while ((c = getopt(argc, argv, "d:a:s:t:")) != -1) {
+		switch (c) {
+		case 'd':
+			ctrldev = optarg;
+			break;
+		case 'a':
+			adapter = atoi(optarg);
+			break;
+		case 's':
+			speed = atof(optarg);
+			break;
+		case 't':
+			type = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind >= argc)
+		usage(argv[0]);
+
+	for (; optind < argc; optind++)
+		load(argv[optind]);
+	if (!nrecs) {
+		fprintf(stderr, "no records\n");
+		return 1;
+	}
+	qsort(recs, nrecs, sizeof(*recs), rec_cmp);
+
+	ctrl = open(ctrldev, O_RDWR);
+	if (ctrl < 0) {
+		perror(ctrldev);
+		return 1;
+	}
+	discover(ctrl);
+	if (type) {
+		ioctl(ctrl, VTUNER_SET_NAME, "vtunerc_replay");
+		if (ioctl(ctrl, VTUNER_SET_TYPE, type))
+			perror("VTUNER_SET_TYPE");
+	}
+
+	snprintf(path, sizeof(path), "/dev/dvb/adapter%d/dvr0", adapter);
+	dvr = open(path, O_RDONLY | O_NONBLOCK);
+	if (dvr < 0) {
+		perror(path);
+		return 1;
+	}
+
+	t0 = recs[0].hdr.time_ns;
+	start = now_ns();
+
+	for (i = 0; i < nrecs; i++) {
+		struct rec *r = &recs[i];
+
+		due = start;
+		if (speed > 0)
+			due += (u64)((r->hdr.time_ns - t0) / speed);
+		serve(ctrl, dvr, due);
+
+		switch (r->hdr.type) {
+		case VTUNER_CAPTURE_TS:
+			cnt = 0;
+			for (;;) {
+				iov[cnt].iov_base = recs[i].data;
+				iov[cnt].iov_len = recs[i].hdr.len;
+				cnt++;
+				if (cnt == MAX_IOV || i + 1 == nrecs ||
+						recs[i + 1].hdr.type != VTUNER_CAPTURE_TS ||
+						recs[i + 1].hdr.call != r->hdr.call)
+					break;
+				i++;
+			}
+			write_ts(ctrl, iov, cnt);
+			break;
+		case VTUNER_CAPTURE_FEED_START:
+			feed_start((struct vtuner_capture_feed *)r->data);
+			break;
+		case VTUNER_CAPTURE_FEED_STOP:
+			feed_stop((struct vtuner_capture_feed *)r->data);
+			break;
+		default:
+			/* requests come live from the driver */
+			break;
+		}
+	}
+
+	/* let the demux settle */
+	serve(ctrl, dvr, now_ns() + 200000000ULL);
+	elapsed = now_ns() - start;
+
+	printf("records      : %u over %.3f s (captured %.3f s)\n", nrecs,
+			elapsed / 1e9,
+			(recs[nrecs - 1].hdr.time_ns - t0) / 1e9);
+	printf("TS written   : %llu bytes in %llu writes, %.1f Mbit/s\n",
+			(unsigned long long)st.ts_bytes,
+			(unsigned long long)st.ts_calls,
+			st.ts_bytes * 8 / (elapsed / 1e9) / 1e6);
+	if (st.ts_calls)
+		printf("write()      : avg %.1f us, max %.1f us\n",
+			st.wr_ns_total / 1e3 / st.ts_calls,
+			st.wr_ns_max / 1e3);
+	printf("requests     : %llu answered, %llu from capture\n",
+			(unsigned long long)st.answered,
+			(unsigned long long)st.replayed);
+	printf("read back    : %llu bytes dvr0, %llu bytes sections\n",
+			(unsigned long long)st.dvr_bytes,
+			(unsigned long long)st.sec_bytes);
+
+	for (c = 0; c < nfilters; c++)
+		close(filters[c].fd);
+	close(dvr);
+	close(ctrl);
+
+	return 0;
+}
@@ -20,6 +20,7 @@
 #include <linux/dvb/version.h>
 #include <linux/dvb/frontend.h>
 #include <linux/dvb/dmx.h>
+#include <linux/dvb/ca.h>
 
 #define VT_NULL 0x00
 #define VT_S   0x01
@@ -43,6 +44,11 @@
 #define MSG_TYPE_CHANGED		15
 #define MSG_SET_PROPERTY		16
 #define MSG_GET_PROPERTY		17
+#define MSG_SECFILTER			18
+#define MSG_CA_RESET			19
+#define MSG_CA_SEND_MSG			20
+#define MSG_CA_SET_DESCR		21
+#define MSG_CA_SET_PID			22
 
 #define MSG_NULL			1024
 #define MSG_DISCOVER			1025
@@ -96,11 +102,213 @@ struct vtuner_message {
 		u16 pidlist[30];
 		u8  pad[72];
 		u32 type_changed;
+		struct {
+			u32	version;
+			u32	caps;
+		} discover;
+		struct {
+			u16	pid;
+			u8	op;		/* VTUNER_SECFILTER_* */
+			u8	reserved;
+			u8	filter[16];	/* as in struct dmx_filter */
+			u8	mask[16];
+			u8	mode[16];
+		} secfilter;
+	} body;
+};
+
+/*
+ * Versioned protocol
+ *
+ * The daemon negotiates right after open() by VTUNER_DISCOVER with
+ * a MSG_DISCOVER message carrying its protocol version and the
+ * capabilities it wants; the driver answers with the version and the
+ * capabilities it agreed to. Daemons which never ask get the legacy
+ * fixed-size struct vtuner_message protocol.
+ *
+ * With VTUNER_CAP_FRAMED, read() returns records of struct vtuner_msg_hdr
+ * followed by 'len' bytes of the message body, each record padded
+ * to VTUNER_MSG_ALIGN. The buffer must hold at least VTUNER_MSG_MAXREC
+ * bytes. Responses go by VTUNER_SET_RESPONSE_FRAMED and must carry the
+ * 'seq' of the request, stale ones are dropped.
+ */
+#define VTUNER_PROTO_VERSION	2
+
+#define VTUNER_CAP_FRAMED	0x00000001
+#define VTUNER_CAP_SECFILTER	0x00000002
+
+/*
+ * With VTUNER_CAP_SECFILTER the daemon gets MSG_SECFILTER (no response)
+ * for PIDs in the PID list that only section filters use: ADD once per
+ * filter, CLEAR when the set changes or goes. A PID with filters need
+ * only carry sections matching one of them, without any it is sent
+ * whole as before.
+ *
+ * While a full TS feed runs, MSG_PIDLIST holds the single entry 0x2000:
+ * the daemon sends the whole transport stream and section filters do
+ * not apply.
+ */
+#define VTUNER_SECFILTER_CLEAR	0
+#define VTUNER_SECFILTER_ADD	1
+
+#define VTUNER_MSGF_RESPONSE	0x0001	/* request waits for response */
+
+struct vtuner_msg_hdr {
+	u8	version;
+	u8	reserved;
+	u16	flags;
+	u16	len;
+	u16	reserved2;
+	u32	seq;
+	s32	type;
+};
+
+#define VTUNER_MSG_ALIGN	4
+#define VTUNER_MSG_MAXREC	(sizeof(struct vtuner_msg_hdr) + \
+		((sizeof(((struct vtuner_message *)0)->body) + VTUNER_MSG_ALIGN - 1) & \
+		 ~(VTUNER_MSG_ALIGN - 1)))
+
+/*
+ * Shared-memory control mailbox, mmap() of /dev/vtunercX after
+ * VTUNER_SET_MBOX. Requests go kernel -> daemon in 'req', responses
+ * daemon -> kernel in 'rsp'. The producer fills msg[head % VTUNER_MBOX_SLOTS]
+ * and then increments head, the consumer increments tail.
+ *
+ * Doorbells: the kernel signals the eventfd given to VTUNER_SET_MBOX
+ * after queueing a request while 'daemon_waits' is set; the daemon calls
+ * VTUNER_MBOX_KICK after queueing a response or consuming requests while
+ * 'kernel_waits' is set.
+ */
+#define VTUNER_MBOX_VERSION	1
+#define VTUNER_MBOX_SLOTS	16
+
+struct vtuner_mbox_ring {
+	u32 head;
+	u32 pad0[15];
+	u32 tail;
+	u32 pad1[15];
+	struct vtuner_message msg[VTUNER_MBOX_SLOTS];
+};
+
+struct vtuner_mbox {
+	u32 version;
+	u32 kernel_waits;
+	u32 daemon_waits;
+	u32 pad[13];
+	struct vtuner_mbox_ring req;
+	struct vtuner_mbox_ring rsp;
+};
+
+/*
+ * De-jitter stage in front of the demux, see VTUNER_SET_DEJITTER.
+ * 'size' is the buffer in bytes (0 switches the stage off),
+ * 'latency_ms' the fill to keep before releasing at stream rate.
+ * Values above the limits below are refused with EINVAL.
+ */
+#define VTUNER_PCR_PID_AUTO	0xffff
+#define VTUNER_DEJITTER_MAXSIZE	(8 << 20)	/* bytes */
+#define VTUNER_DEJITTER_MAXLATENCY 10000	/* ms */
+
+struct vtuner_dejitter {
+	u32	size;
+	u32	latency_ms;
+	u16	pcr_pid;
+	u16	reserved;
+};
+
+/*
+ * Capture, debugfs vtunerc/vtunercN/capture<cpu> files (relay).
+ * Each record is this header followed by 'len' bytes of payload;
+ * merge the per-CPU files by 'time_ns' (monotonic) to get the original
+ * order.
+ *   VTUNER_CAPTURE_TS      TS as written to the control device,
+ *                          records of one write() share 'call'
+ *   VTUNER_CAPTURE_REQ     struct vtuner_message waiting for response
+ *   VTUNER_CAPTURE_NOTIFY  struct vtuner_message without response
+ *   VTUNER_CAPTURE_RSP     struct vtuner_message, the response to
+ *                          the REQ with the same 'call'
+ *   VTUNER_CAPTURE_FEED_START, VTUNER_CAPTURE_FEED_STOP
+ *                          struct vtuner_capture_feed
+ */
+#define VTUNER_CAPTURE_MAGIC	0x76746370	/* "vtcp" */
+
+#define VTUNER_CAPTURE_TS		0
+#define VTUNER_CAPTURE_REQ		1
+#define VTUNER_CAPTURE_NOTIFY		2
+#define VTUNER_CAPTURE_RSP		3
+#define VTUNER_CAPTURE_FEED_START	4
+#define VTUNER_CAPTURE_FEED_STOP	5
+
+struct vtuner_capture_rec {
+	u32	magic;
+	u32	len;
+	u64	time_ns;
+	u32	call;
+	u32	type;
+};
+
+#define VTUNER_FEED_TS		0
+#define VTUNER_FEED_SEC		1
+
+struct vtuner_capture_feed {
+	u16	pid;
+	u16	feed_type;	/* VTUNER_FEED_* */
+};
+
+/*
+ * Packet format of the TS written to /dev/vtunercX (VTUNER_SET_PKTFMT),
+ * the extra bytes are dropped on the way in. 192 byte packets carry
+ * a 4 byte header with a 30 bit 27 MHz arrival time stamp in front
+ * (as in M2TS), 204 byte ones 16 bytes of RS parity behind.
+ */
+#define VTUNER_PKTFMT_188	188
+#define VTUNER_PKTFMT_192	192
+#define VTUNER_PKTFMT_204	204
+
+/*
+ * CA device, /dev/dvb/adapterN/ca0. The daemon describes the remote
+ * CAM by VTUNER_SET_CA_INFO (again whenever it changes): CA_GET_CAP,
+ * CA_GET_SLOT_INFO and CA_GET_DESCR_INFO are answered from it.
+ * CA_RESET, CA_SEND_MSG (CA_PMT and the other high level messages),
+ * CA_SET_DESCR and CA_SET_PID become struct vtuner_ca_message on a
+ * queue of their own, apart from the frontend requests and without
+ * response. The daemon fetches them by VTUNER_GET_CA_MESSAGE, poll()
+ * of /dev/vtunercX signals them by POLLRDBAND. 'seq' counts the
+ * messages, a gap means the queue overflowed.
+ */
+#define VTUNER_CA_SLOTS		4
+
+struct vtuner_ca_info {
+	struct ca_caps		caps;
+	struct ca_descr_info	descr_info;
+	struct ca_slot_info	slot_info[VTUNER_CA_SLOTS];
+};
+
+struct vtuner_ca_message {
+	s32	type;		/* MSG_CA_* */
+	u32	seq;
+	union {
+		struct ca_msg	msg;
+		struct ca_descr	descr;
+		struct {
+			u32	pid;
+			s32	index;	/* descrambler, -1 disables */
+		} pid;
 	} body;
 };
 
 #define VTUNER_MAJOR		226
 
+/*
+ * Requests can be fetched by VTUNER_GET_MESSAGE one by one, or by read()
+ * of /dev/vtunercX, which returns as many queued struct vtuner_message
+ * as are pending and fit in the buffer. Responses go by VTUNER_SET_RESPONSE.
+ *
+ * A daemon taking over from one that went away gets the last tune, SEC
+ * requests, PID list and section filters again after its first
+ * VTUNER_SET_TYPE, so VTUNER_DISCOVER and VTUNER_SET_MBOX go before it.
+ */
+
 /*#define PVR_FLUSH_BUFFER	_IO(VTUNER_MAJOR, 0)*/
 #define VTUNER_GET_MESSAGE	_IOR(VTUNER_MAJOR, 1, struct vtuner_message *)
 #define VTUNER_SET_RESPONSE 	_IOW(VTUNER_MAJOR, 2, struct vtuner_message *)
@@ -109,6 +317,15 @@ struct vtuner_message {
 #define VTUNER_SET_FE_INFO	_IOW(VTUNER_MAJOR, 6, struct dvb_frontend_info *)
 #define VTUNER_SET_NUM_MODES	_IOW(VTUNER_MAJOR, 7, int)
 #define VTUNER_SET_MODES	_IOW(VTUNER_MAJOR, 8, char *)
+#define VTUNER_SET_MBOX		_IOW(VTUNER_MAJOR, 9, int)	/* eventfd, -1 disables */
+#define VTUNER_MBOX_KICK	_IO(VTUNER_MAJOR, 10)
+#define VTUNER_DISCOVER		_IOWR(VTUNER_MAJOR, 11, struct vtuner_message)
+#define VTUNER_SET_RESPONSE_FRAMED _IOW(VTUNER_MAJOR, 12, struct vtuner_msg_hdr)
+#define VTUNER_SET_TS_SOCKET	_IOW(VTUNER_MAJOR, 13, int)	/* socket fd, -1 stops */
+#define VTUNER_SET_DEJITTER	_IOW(VTUNER_MAJOR, 14, struct vtuner_dejitter)
+#define VTUNER_SET_PKTFMT	_IOW(VTUNER_MAJOR, 15, int)	/* VTUNER_PKTFMT_* */
+#define VTUNER_SET_CA_INFO	_IOW(VTUNER_MAJOR, 16, struct vtuner_ca_info)
+#define VTUNER_GET_CA_MESSAGE	_IOR(VTUNER_MAJOR, 17, struct vtuner_ca_message)
 
 #endif
 
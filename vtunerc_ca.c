@@ -0,0 +1,282 @@
+/*
+ * vtunerc: CA device proxy
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * ca0 stands for the CAM behind the daemon. Queries are answered from
+ * the struct vtuner_ca_info the daemon set last, everything else goes
+ * to the daemon on a queue of its own, without response: a control
+ * word change costs a copy and a wake-up, it never waits for a
+ * frontend request holding xchange_sem nor for ioctl_sem.
+ *
+ * A full queue drops the oldest message, the newest control words are
+ * the ones that matter; the daemon sees the gap in 'seq'.
+ * ca->lock guards the queue and the info.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+
+#include "vtunerc_priv.h"
+
+#define VTUNERC_CA_QLEN		64
+#define VTUNERC_CA_USERS	4	/* ca0 opened at the same time */
+
+struct vtunerc_ca {
+	spinlock_t lock;
+	struct vtuner_ca_info info;
+	struct vtuner_ca_message q[VTUNERC_CA_QLEN];
+	unsigned int head;
+	unsigned int tail;
+	u32 seq;
+};
+
+static int vtunerc_ca_put(struct vtunerc_ctx *ctx,
+				struct vtuner_ca_message *m)
+{
+	struct vtunerc_ca *ca = ctx->ca_priv;
+
+	if (ctx->fd_opened < 1)
+		return -ENODEV;
+
+	spin_lock(&ca->lock);
+	if (ca->head - ca->tail == VTUNERC_CA_QLEN)
+		ca->tail++;
+	m->seq = ca->seq++;
+	memcpy(&ca->q[ca->head % VTUNERC_CA_QLEN], m, sizeof(*m));
+	ca->head++;
+	spin_unlock(&ca->lock);
+
+	vtunerc_stats_msg(ctx, m->type, 0);
+	wake_up_interruptible(&ctx->ctrldev_wait_request_wq);
+
+	return 0;
+}
+
+/* returns 0 when a message was taken */
+static int vtunerc_ca_get(struct vtunerc_ctx *ctx, struct vtuner_ca_message *m)
+{
+	struct vtunerc_ca *ca = ctx->ca_priv;
+	int ret = -EAGAIN;
+
+	spin_lock(&ca->lock);
+	if (ca->head != ca->tail) {
+		memcpy(m, &ca->q[ca->tail % VTUNERC_CA_QLEN], sizeof(*m));
+		ca->tail++;
+		ret = 0;
+	}
+	spin_unlock(&ca->lock);
+
+	return ret;
+}
+
+int vtunerc_ca_pending(struct vtunerc_ctx *ctx)
+{
+	struct vtunerc_ca *ca = ctx->ca_priv;
+
+	return ca && ca->head != ca->tail;
+}
+
+static int vtunerc_ca_ioctl(struct file *file, unsigned int cmd, void *parg)
+{
+	struct dvb_device *dvbdev = file->private_data;
+	struct vtunerc_ctx *ctx = dvbdev->priv;
+	struct vtunerc_ca *ca = ctx->ca_priv;
+	struct vtuner_ca_message m;
+	struct ca_slot_info *slot;
+	struct ca_msg *msg;
+	int ret = 0;
+
+	memset(&m, 0, sizeof(m));
+
+	switch (cmd) {
+	case CA_GET_CAP:
+		spin_lock(&ca->lock);
+		memcpy(parg, &ca->info.caps, sizeof(ca->info.caps));
+		spin_unlock(&ca->lock);
+		break;
+
+	case CA_GET_DESCR_INFO:
+		spin_lock(&ca->lock);
+		memcpy(parg, &ca->info.descr_info, sizeof(ca->info.descr_info));
+		spin_unlock(&ca->lock);
+		break;
+
+	case CA_GET_SLOT_INFO:
+		slot = parg;
+		spin_lock(&ca->lock);
+		if (slot->num < 0 || slot->num >= VTUNER_CA_SLOTS ||
+				slot->num >= ca->info.caps.slot_num)
+			ret = -EINVAL;
+		else
+			memcpy(slot, &ca->info.slot_info[slot->num],
+					sizeof(*slot));
+		spin_unlock(&ca->lock);
+		break;
+
+	case CA_RESET:
+		m.type = MSG_CA_RESET;
+		ret = vtunerc_ca_put(ctx, &m);
+		break;
+
+	case CA_SEND_MSG:
+		msg = parg;
+		if (msg->length > sizeof(msg->msg)) {
+			ret = -EINVAL;
+			break;
+		}
+		m.type = MSG_CA_SEND_MSG;
+		memcpy(&m.body.msg, msg, sizeof(*msg));
+		ret = vtunerc_ca_put(ctx, &m);
+		break;
+
+	case CA_SET_DESCR:
+		m.type = MSG_CA_SET_DESCR;
+		memcpy(&m.body.descr, parg, sizeof(m.body.descr));
+		ret = vtunerc_ca_put(ctx, &m);
+		break;
+
+#ifdef CA_SET_PID
+	case CA_SET_PID: {
+		struct ca_pid *pid = parg;
+
+		m.type = MSG_CA_SET_PID;
+		m.body.pid.pid = pid->pid;
+		m.body.pid.index = pid->index;
+		ret = vtunerc_ca_put(ctx, &m);
+		break;
+	}
+#endif
+
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	return ret;
+}
+
+/* VTUNER_SET_CA_INFO and VTUNER_GET_CA_MESSAGE, without ioctl_sem */
+long vtunerc_ca_ctrldev_ioctl(struct vtunerc_ctx *ctx, struct file *filp,
+				unsigned int cmd, unsigned long arg)
+{
+	struct vtunerc_ca *ca = ctx->ca_priv;
+	struct vtuner_ca_info info;
+	struct vtuner_ca_message m;
+	int i;
+
+	if (!ca)
+		return -ENODEV;
+
+	switch (cmd) {
+	case VTUNER_SET_CA_INFO:
+		if (copy_from_user(&info, (char *)arg, sizeof(info)))
+			return -EFAULT;
+		for (i = 0; i < VTUNER_CA_SLOTS; i++)
+			info.slot_info[i].num = i;
+		spin_lock(&ca->lock);
+		memcpy(&ca->info, &info, sizeof(info));
+		spin_unlock(&ca->lock);
+		dprintk(ctx, "CA info: %u slots, %u descramblers\n",
+				info.caps.slot_num, info.caps.descr_num);
+		return 0;
+
+	case VTUNER_GET_CA_MESSAGE:
+		if (filp->f_flags & O_NONBLOCK) {
+			if (vtunerc_ca_get(ctx, &m))
+				return -EAGAIN;
+		} else if (wait_event_interruptible(ctx->ctrldev_wait_request_wq,
+					!vtunerc_ca_get(ctx, &m) ||
+					ctx->closing)) {
+			return -ERESTARTSYS;
+		} else if (ctx->closing) {
+			return -EINTR;
+		}
+		if (copy_to_user((char *)arg, &m, sizeof(m)))
+			return -EFAULT;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+/* the last daemon went away, and the CAM with it */
+void vtunerc_ca_disconnect(struct vtunerc_ctx *ctx)
+{
+	struct vtunerc_ca *ca = ctx->ca_priv;
+
+	if (!ca)
+		return;
+
+	spin_lock(&ca->lock);
+	ca->tail = ca->head;
+	memset(&ca->info, 0, sizeof(ca->info));
+	spin_unlock(&ca->lock);
+}
+
+static const struct file_operations vtunerc_ca_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = dvb_generic_ioctl,
+	.open = dvb_generic_open,
+	.release = dvb_generic_release,
+	.llseek = noop_llseek,
+};
+
+static const struct dvb_device vtunerc_ca_template = {
+	.users = VTUNERC_CA_USERS,
+	.readers = VTUNERC_CA_USERS,
+	.writers = VTUNERC_CA_USERS,
+	.fops = &vtunerc_ca_fops,
+	.kernel_ioctl = vtunerc_ca_ioctl,
+};
+
+int vtunerc_ca_init(struct vtunerc_ctx *ctx)
+{
+	struct vtunerc_ca *ca;
+	int ret;
+
+	ca = vzalloc(sizeof(*ca));
+	if (!ca)
+		return -ENOMEM;
+
+	spin_lock_init(&ca->lock);
+	ctx->ca_priv = ca;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	ret = dvb_register_device(&ctx->dvb_adapter, &ctx->ca,
+			&vtunerc_ca_template, ctx, DVB_DEVICE_CA, 0);
+#else
+	ret = dvb_register_device(&ctx->dvb_adapter, &ctx->ca,
+			&vtunerc_ca_template, ctx, DVB_DEVICE_CA);
+#endif
+	if (ret < 0) {
+		printk(KERN_ERR "vtunerc%d: failed to register ca0\n", ctx->idx);
+		ctx->ca_priv = NULL;
+		vfree(ca);
+		return ret;
+	}
+
+	return 0;
+}
+
+void vtunerc_ca_exit(struct vtunerc_ctx *ctx)
+{
+	if (!ctx->ca_priv)
+		return;
+
+	dvb_unregister_device(ctx->ca);
+	ctx->ca = NULL;
+	vfree(ctx->ca_priv);
+	ctx->ca_priv = NULL;
+}
@@ -0,0 +1,244 @@
+/*
+ * vtunerc: TS capture tap
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Flight recorder of injected TS, control messages and feed changes.
+ * Writing a size in KiB to debugfs vtunerc/vtunercN/capture_kb opens
+ * a relay channel of that size in overwrite mode, 0 closes it. Relay
+ * keeps per-CPU buffers, appends need no locking beyond disabled
+ * preemption, so the write path only pays for a pointer test while
+ * the capture is off. The size is the total, split over the possible
+ * CPUs; capture_kb reads back what was allocated.
+ *
+ * TS is recorded once per write(), iovec or socket batch, as the 188
+ * byte packets given to the demux.
+ *
+ * ctx->capture changes under both tswrite_sem and ctrldev_lock;
+ * TS is recorded under the former, everything else under the latter.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/relay.h>
+#include <linux/ktime.h>
+#include <linux/cpumask.h>
+#include <linux/math64.h>
+
+#include "vtunerc_priv.h"
+
+#if defined(CONFIG_RELAY) && defined(CONFIG_DEBUG_FS)
+
+#define VTUNERC_CAP_SUBBUF	(128 * 1024)
+#define VTUNERC_CAP_MAXDATA	(((VTUNERC_CAP_SUBBUF - \
+		sizeof(struct vtuner_capture_rec)) / 188) * 188)
+#define VTUNERC_CAP_MAXKB	(1024 * 1024)
+
+static void vtunerc_capture_put(struct rchan *chan, u32 type, u32 call,
+					const void *data, size_t len)
+{
+	struct vtuner_capture_rec rec;
+	u8 *p;
+
+	rec.magic = VTUNER_CAPTURE_MAGIC;
+	rec.len = len;
+	rec.time_ns = ktime_to_ns(ktime_get());
+	rec.call = call;
+	rec.type = type;
+
+	preempt_disable();
+	p = relay_reserve(chan, sizeof(rec) + len);
+	if (p) {
+		memcpy(p, &rec, sizeof(rec));
+		memcpy(p + sizeof(rec), data, len);
+	}
+	preempt_enable();
+}
+
+/* caller holds tswrite_sem */
+void vtunerc_capture_ts(struct vtunerc_ctx *ctx, const u8 *buf, size_t len)
+{
+	u32 call = (u32)ctx->ts_stats.wr_calls;
+	size_t n;
+
+	while (len) {
+		n = min_t(size_t, len, VTUNERC_CAP_MAXDATA);
+		vtunerc_capture_put(ctx->capture, VTUNER_CAPTURE_TS, call,
+					buf, n);
+		buf += n;
+		len -= n;
+	}
+}
+
+/*
+ * requests get a new sequence number, returned so the caller can
+ * record the response (VTUNER_CAPTURE_RSP) under the same one
+ */
+u32 vtunerc_capture_msg(struct vtunerc_ctx *ctx, u32 type, u32 seq,
+			const struct vtuner_message *msg)
+{
+	spin_lock(&ctx->ctrldev_lock);
+	if (ctx->capture) {
+		if (type != VTUNER_CAPTURE_RSP)
+			seq = ++ctx->capture_seq;
+		vtunerc_capture_put(ctx->capture, type, seq, msg,
+					sizeof(*msg));
+	}
+	spin_unlock(&ctx->ctrldev_lock);
+
+	return seq;
+}
+
+void vtunerc_capture_feed(struct vtunerc_ctx *ctx, int start, u16 pid,
+				int feed_type)
+{
+	struct vtuner_capture_feed feed = {
+		.pid = pid,
+		.feed_type = feed_type == DMX_TYPE_SEC ?
+				VTUNER_FEED_SEC : VTUNER_FEED_TS,
+	};
+
+	spin_lock(&ctx->ctrldev_lock);
+	if (ctx->capture)
+		vtunerc_capture_put(ctx->capture, start ?
+					VTUNER_CAPTURE_FEED_START :
+					VTUNER_CAPTURE_FEED_STOP,
+					0, &feed, sizeof(feed));
+	spin_unlock(&ctx->ctrldev_lock);
+}
+
+/* keep only the newest data */
+static int vtunerc_capture_subbuf_start(struct rchan_buf *buf, void *subbuf,
+					void *prev_subbuf, size_t prev_padding)
+{
+	return 1;
+}
+
+static struct dentry *vtunerc_capture_create_buf_file(const char *filename,
+					struct dentry *parent, umode_t mode,
+					struct rchan_buf *buf, int *is_global)
+{
+	return debugfs_create_file(filename, mode, parent, buf,
+					&relay_file_operations);
+}
+
+static int vtunerc_capture_remove_buf_file(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+	return 0;
+}
+
+static struct rchan_callbacks vtunerc_capture_cb = {
+	.subbuf_start		= vtunerc_capture_subbuf_start,
+	.create_buf_file	= vtunerc_capture_create_buf_file,
+	.remove_buf_file	= vtunerc_capture_remove_buf_file,
+};
+
+static int vtunerc_capture_kb_get(void *data, u64 *val)
+{
+	struct vtunerc_ctx *ctx = data;
+
+	*val = ctx->capture_kb;
+
+	return 0;
+}
+
+static int vtunerc_capture_kb_set(void *data, u64 val)
+{
+	struct vtunerc_ctx *ctx = data;
+	struct rchan *chan;
+	size_t n;
+	int ret = 0;
+
+	if (val > VTUNERC_CAP_MAXKB)
+		return -EINVAL;
+
+	if (down_interruptible(&ctx->tswrite_sem))
+		return -ERESTARTSYS;
+
+	spin_lock(&ctx->ctrldev_lock);
+	chan = ctx->capture;
+	ctx->capture = NULL;
+	ctx->capture_kb = 0;
+	spin_unlock(&ctx->ctrldev_lock);
+
+	if (chan)
+		relay_close(chan);
+
+	if (val) {
+		/* relay allocates n sub-buffers for each CPU */
+		n = max_t(size_t, 2, DIV_ROUND_UP(div_u64(val * 1024,
+				num_possible_cpus()), VTUNERC_CAP_SUBBUF));
+		chan = relay_open("capture", ctx->dbgfs, VTUNERC_CAP_SUBBUF, n,
+					&vtunerc_capture_cb, NULL);
+		if (chan) {
+			spin_lock(&ctx->ctrldev_lock);
+			ctx->capture = chan;
+			ctx->capture_kb = n * (VTUNERC_CAP_SUBBUF / 1024) *
+						num_possible_cpus();
+			ctx->capture_seq = 0;
+			spin_unlock(&ctx->ctrldev_lock);
+		} else {
+			ret = -ENOMEM;
+		}
+	}
+
+	up(&ctx->tswrite_sem);
+
+	return ret;
+}
+
+DEFINE_SIMPLE_ATTRIBUTE(vtunerc_capture_kb_fops, vtunerc_capture_kb_get,
+			vtunerc_capture_kb_set, "%llu\n");
+
+void vtunerc_capture_init(struct vtunerc_ctx *ctx)
+{
+	if (!IS_ERR_OR_NULL(ctx->dbgfs))
+		debugfs_create_file("capture_kb", S_IRUSR | S_IWUSR,
+				ctx->dbgfs, ctx, &vtunerc_capture_kb_fops);
+}
+
+void vtunerc_capture_exit(struct vtunerc_ctx *ctx)
+{
+	if (ctx->capture)
+		relay_close(ctx->capture);
+	ctx->capture = NULL;
+	ctx->capture_kb = 0;
+}
+
+#else
+
+void vtunerc_capture_ts(struct vtunerc_ctx *ctx, const u8 *buf, size_t len)
+{
+}
+
+u32 vtunerc_capture_msg(struct vtunerc_ctx *ctx, u32 type, u32 seq,
+			const struct vtuner_message *msg)
+{
+	return 0;
+}
+
+void vtunerc_capture_feed(struct vtunerc_ctx *ctx, int start, u16 pid,
+				int feed_type)
+{
+}
+
+void vtunerc_capture_init(struct vtunerc_ctx *ctx)
+{
+}
+
+void vtunerc_capture_exit(struct vtunerc_ctx *ctx)
+{
+}
+
+#endif
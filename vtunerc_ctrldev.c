@@ -19,98 +19,1094 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/delay.h>
+#include <linux/sched.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/vmalloc.h>
+#include <linux/eventfd.h>
 
 #include <linux/time.h>
 #include <linux/poll.h>
+#include <linux/interrupt.h>
+#include <linux/workqueue.h>
 
 #include "vtunerc_priv.h"
+#include "vtunerc_trace.h"
 
 #define VTUNERC_CTRLDEV_MAJOR	266
 #define VTUNERC_CTRLDEV_NAME	"vtunerc"
 
 #define VTUNER_MSG_LEN (sizeof(struct vtuner_message))
 
+#define VTUNERC_PIN_CHUNK	16	/* pages pinned at once */
+
+/* make sure kernel_buf can hold len bytes, caller holds tswrite_sem */
+static int vtunerc_ctrldev_alloc_buf(struct vtunerc_ctx *ctx, size_t len)
+{
+	if (ctx->kernel_buf && len <= ctx->kernel_buf_size)
+		return 0;
+
+	// free old buffer
+	if (ctx->kernel_buf) {
+		kfree(ctx->kernel_buf);
+		ctx->kernel_buf = NULL;
+		ctx->kernel_buf_size = 0;
+	}
+	// allocate a bigger buffer
+	ctx->kernel_buf = kmalloc(len, GFP_KERNEL);
+	if (!ctx->kernel_buf) {
+		printk(KERN_ERR "vtunerc%d: unable to allocate buffer of %Zu bytes\n", ctx->idx, len);
+		return -ENOMEM;
+	}
+	ctx->kernel_buf_size = len;
+	printk(KERN_INFO "vtunerc%d: allocated buffer of %Zu bytes\n", ctx->idx, len);
+
+	return 0;
+}
+
+static void vtunerc_ctrldev_dispatch(struct vtunerc_ctx *ctx, const u8 *buf,
+					size_t count)
+{
+	if (ctx->dejitter)
+		vtunerc_dejitter_put(ctx, buf, count * 188);
+	else
+		dvb_dmx_swfilter_packets(&ctx->demux, buf, count);
+}
+
+#define VTUNERC_BULK_PKTS	348	/* 64 KiB, keeps DVR overflows partial */
+
+/* count a packet, the rates walk only PIDs which got some */
+static inline void vtunerc_ctrldev_count(struct vtunerc_ctx *ctx,
+					unsigned int pid, size_t n)
+{
+	struct vtunerc_pidstat *ps = &ctx->pidstat[pid];
+
+	if (unlikely(!ps->active)) {
+		ps->active = 1;
+		ctx->ratepid[ctx->nratepids++] = pid;
+	}
+	ps->packets += n;
+}
+
+/* as dvb_demux, the DVR gets each packet only once */
+#define VTUNERC_DVR_FEED(f)	((f)->type == DMX_TYPE_TS && \
+		((f)->ts_type & (TS_PACKET | TS_DEMUX)) == TS_PACKET)
+
+/*
+ * only full TS feeds run: give them the batch in large blocks instead
+ * of packet by packet through dvb_dmx_swfilter_packets(). Returns 0
+ * when another feed has started meanwhile and the demux must do it.
+ */
+static int vtunerc_ctrldev_bulk(struct vtunerc_ctx *ctx, const u8 *buf,
+					size_t count)
+{
+	struct dvb_demux *demux = &ctx->demux;
+	struct dvb_demux_feed *feed;
+	unsigned long flags;
+	size_t n;
+	int dvr_done, ret = 0;
+
+	spin_lock_irqsave(&demux->lock, flags);
+
+	list_for_each_entry(feed, &demux->feed_list, list_head)
+		if (feed->state == DMX_STATE_GO &&
+				(feed->pid != 0x2000 || feed->type != DMX_TYPE_TS))
+			goto out;
+
+	for (; count; count -= n, buf += n * 188) {
+		n = min_t(size_t, count, VTUNERC_BULK_PKTS);
+		dvr_done = 0;
+		list_for_each_entry(feed, &demux->feed_list, list_head) {
+			if (feed->state != DMX_STATE_GO)
+				continue;
+			if (VTUNERC_DVR_FEED(feed) && dvr_done++)
+				continue;
+			vtunerc_dmx_ts_cb(feed, buf, n * 188);
+		}
+		vtunerc_ctrldev_count(ctx, 0x2000, n);
+	}
+	ret = 1;
+out:
+	spin_unlock_irqrestore(&demux->lock, flags);
+
+	return ret;
+}
+
+/*
+ * validate packets (tscheck) and drop null packets and PIDs without
+ * active feed before they reach the demux; passing packets go on
+ * in runs as long as possible
+ */
+static void vtunerc_ctrldev_filter(struct vtunerc_ctx *ctx, const u8 *buf,
+					size_t count, struct vtunerc_ts_stats *st)
+{
+	int check = ctx->config->tscheck;
+	int fullts = test_bit(0x2000, ctx->pidmap);
+	int suspect = 0;
+	const u8 *run = buf;
+	size_t i, runlen = 0;
+	unsigned int pid;
+
+	if (!check && fullts) {
+		if (ctx->pidtab_len == 1 && !ctx->dejitter &&
+				vtunerc_ctrldev_bulk(ctx, buf, count)) {
+			/* PSI is not followed in bulk, the cache goes stale */
+			if (!ctx->tsbulk)
+				vtunerc_psi_reset(ctx);
+			ctx->tsbulk = 1;
+			return;
+		}
+		ctx->tsbulk = 0;
+		for (i = 0; i < count; i++, buf += 188) {
+			pid = ((buf[1] & 0x1f) << 8) | buf[2];
+			vtunerc_ctrldev_count(ctx, pid, 1);
+			if (unlikely(test_bit(pid, ctx->psimap)))
+				vtunerc_psi_ts(ctx, buf);
+		}
+		vtunerc_ctrldev_dispatch(ctx, buf - count * 188, count);
+		return;
+	}
+
+	ctx->tsbulk = 0;
+	if (check)
+		suspect = vtunerc_ts_batch_bad(buf, count);
+
+	for (i = 0; i < count; i++, buf += 188) {
+		if (check && !vtunerc_ts_check(ctx->pidstat, buf, suspect, st)) {
+			if (buf[0] != 0x47 && printk_ratelimit())
+				printk(KERN_ERR "vtunerc%d: Data not start on packet boundary: data=%02x %02x %02x %02x %02x ...\n",
+						ctx->idx, buf[0], buf[1], buf[2], buf[3], buf[4]);
+			goto drop;
+		}
+
+		pid = ((buf[1] & 0x1f) << 8) | buf[2];
+		vtunerc_ctrldev_count(ctx, pid, 1);
+		if (unlikely(test_bit(pid, ctx->psimap)))
+			vtunerc_psi_ts(ctx, buf);
+		if (likely(fullts || test_bit(pid, ctx->pidmap))) {
+			if (!runlen)
+				run = buf;
+			runlen++;
+			continue;
+		}
+
+		if (pid == 0x1fff)
+			st->drop_null++;
+		else
+			st->drop_pid++;
+drop:
+		if (runlen) {
+			vtunerc_ctrldev_dispatch(ctx, run, runlen);
+			runlen = 0;
+		}
+	}
+
+	if (runlen)
+		vtunerc_ctrldev_dispatch(ctx, run, runlen);
+}
+
+/*
+ * refresh the moving average bitrates, once a second from the write
+ * path or on a stats read; rate = 3/4 old + 1/4 last interval, and
+ * each further second without packets takes another quarter off.
+ * PIDs whose rate reached 0 leave ratepid[]. Caller holds tswrite_sem.
+ */
+static void vtunerc_ctrldev_rates(struct vtunerc_ctx *ctx)
+{
+	unsigned long elapsed = jiffies - ctx->rate_stamp;
+	unsigned long idle = min_t(unsigned long, elapsed / HZ, 64);
+	struct vtunerc_pidstat *ps;
+	u64 total = 0, bits;
+	unsigned int i = 0, n;
+
+	/* 0x2000 counts what went to full TS feeds in bulk */
+	while (i < ctx->nratepids) {
+		ps = &ctx->pidstat[ctx->ratepid[i]];
+		if (ps->packets != ps->last_packets) {
+			bits = div_u64((ps->packets - ps->last_packets) *
+					188 * 8 * HZ, elapsed);
+			ps->rate = (ps->rate * 3 + bits) >> 2;
+			ps->last_packets = ps->packets;
+		} else {
+			for (n = 0; n < idle && ps->rate; n++)
+				ps->rate = (ps->rate * 3) >> 2;
+		}
+		if (!ps->rate) {
+			ps->active = 0;
+			ctx->ratepid[i] = ctx->ratepid[--ctx->nratepids];
+			continue;
+		}
+		total += ps->rate;
+		i++;
+	}
+
+	ctx->rate = total;
+	ctx->rate_stamp = jiffies;
+}
+
+/* rates of a stalled ingest decay when read */
+void vtunerc_ctrldev_rates_refresh(struct vtunerc_ctx *ctx)
+{
+	if (time_before(jiffies, ctx->rate_stamp + HZ))
+		return;
+
+	if (down_interruptible(&ctx->tswrite_sem))
+		return;
+	if (time_after_eq(jiffies, ctx->rate_stamp + HZ))
+		vtunerc_ctrldev_rates(ctx);
+	up(&ctx->tswrite_sem);
+}
+
+/* push whole TS packets into the demux, caller holds tswrite_sem */
+static int vtunerc_ctrldev_demux(struct vtunerc_ctx *ctx, const u8 *buf,
+					size_t len)
+{
+	struct vtunerc_ts_stats st = { .wr_bytes = len };
+	size_t count = len / 188, n;
+
+	/*
+	 * IP packets dvb_net decapsulates meanwhile are only queued by
+	 * netif_rx(), the stack takes them all in one softirq run at the
+	 * end of a chunk instead of waking ksoftirqd for each. Chunks of
+	 * VTUNERC_BULK_PKTS keep softirqs from waiting for a whole write.
+	 */
+	for (; count; count -= n, buf += n * 188) {
+		n = min_t(size_t, count, VTUNERC_BULK_PKTS);
+		local_bh_disable();
+		/* counted locally, published once per batch */
+		vtunerc_ctrldev_filter(ctx, buf, n, &st);
+		local_bh_enable();
+	}
+	vtunerc_stats_ts(ctx, &st);
+
+	trace_vtunerc_ts_batch(ctx->idx, len, len / 188,
+			st.drop_null + st.drop_pid + st.drop_sync + st.drop_tei);
+
+	if (time_after_eq(jiffies, ctx->rate_stamp + HZ))
+		vtunerc_ctrldev_rates(ctx);
+
+	return 0;
+}
+
+/*
+ * the demux output can't keep up: dvr0 or the dejitter buffer is more
+ * than 3/4 full. dvr0 readers don't tell us when they drained it, so
+ * backlog_work looks again until the backlog is gone and then wakes
+ * the POLLOUT waiters.
+ */
+static int vtunerc_ctrldev_backlog(struct vtunerc_ctx *ctx)
+{
+	struct dvb_ringbuffer *rb = &ctx->dmxdev.dvr_buffer;
+
+	if (rb->data && dvb_ringbuffer_free(rb) < rb->size / 4)
+		return 1;
+
+	return ctx->dejitter_backlog;
+}
+
+#define VTUNERC_BACKLOG_POLL	msecs_to_jiffies(10)
+
+static void vtunerc_ctrldev_backlog_work(struct work_struct *work)
+{
+	struct vtunerc_ctx *ctx = container_of(to_delayed_work(work),
+					struct vtunerc_ctx, backlog_work);
+
+	if (!vtunerc_ctrldev_backlog(ctx))
+		wake_up_interruptible(&ctx->ctrldev_wait_write_wq);
+	else if (ctx->fd_opened > 0)
+		schedule_delayed_work(&ctx->backlog_work, VTUNERC_BACKLOG_POLL);
+}
+
+void vtunerc_ctrldev_backlog_init(struct vtunerc_ctx *ctx)
+{
+	INIT_DELAYED_WORK(&ctx->backlog_work, vtunerc_ctrldev_backlog_work);
+}
+
+void vtunerc_ctrldev_backlog_exit(struct vtunerc_ctx *ctx)
+{
+	cancel_delayed_work_sync(&ctx->backlog_work);
+}
+
+/*
+ * take tswrite_sem, O_NONBLOCK writers get -EAGAIN when the ingest
+ * is busy or the demux output is backlogged
+ */
+static int vtunerc_ctrldev_tswrite_lock(struct vtunerc_ctx *ctx,
+					struct file *filp)
+{
+	if (filp->f_flags & O_NONBLOCK) {
+		if (down_trylock(&ctx->tswrite_sem))
+			return -EAGAIN;
+		if (vtunerc_ctrldev_backlog(ctx)) {
+			up(&ctx->tswrite_sem);
+			schedule_delayed_work(&ctx->backlog_work,
+						VTUNERC_BACKLOG_POLL);
+			return -EAGAIN;
+		}
+	} else if (down_interruptible(&ctx->tswrite_sem))
+		return -ERESTARTSYS;
+
+	/* tswrite_busy only changes under tswrite_sem, poll() reads it */
+	ctx->tswrite_busy = 1;
+	smp_wmb();
+
+	return 0;
+}
+
+static void vtunerc_ctrldev_tswrite_unlock(struct vtunerc_ctx *ctx)
+{
+	struct vtunerc_ts_stats st = { .wr_calls = 1 };
+
+	vtunerc_stats_ts(ctx, &st);
+	ctx->tswrite_busy = 0;
+	smp_wmb();
+	up(&ctx->tswrite_sem);
+
+	/* let POLLOUT waiters know */
+	wake_up_interruptible(&ctx->ctrldev_wait_write_wq);
+}
+
+static int vtunerc_ctrldev_demux_fn(void *arg, const u8 *buf, size_t len)
+{
+	return vtunerc_ctrldev_demux(arg, buf, len);
+}
+
+/*
+ * demux one chunk copied from pinned user memory, packets crossing
+ * the chunk boundary are assembled in ctx->trail
+ */
+static int vtunerc_ctrldev_demux_piece(struct vtunerc_ctx *ctx,
+					const u8 *buf, size_t len)
+{
+	return vtunerc_ts_align(ctx->trail, &ctx->trailsize, buf, len,
+				vtunerc_ctrldev_demux_fn, ctx);
+}
+
+/*
+ * large writes: pin the user pages a chunk at a time and demux each
+ * chunk as one batch, so kernel_buf never grows past the chunk.
+ * The writer may still change its pages: they are copied out before
+ * anything checks or parses them.
+ * Caller holds tswrite_sem, len is multiple of 188.
+ */
+static ssize_t vtunerc_ctrldev_write_pinned(struct vtunerc_ctx *ctx,
+					const char __user *buff, size_t len)
+{
+	struct page *pages[VTUNERC_PIN_CHUNK];
+	unsigned long addr = (unsigned long)buff;
+	size_t done = 0, n, seg;
+	unsigned int offs;
+	int i, nr, pinned, ret;
+	u8 *va;
+
+	ret = vtunerc_ctrldev_alloc_buf(ctx, VTUNERC_PIN_CHUNK * PAGE_SIZE);
+	if (ret)
+		return ret;
+
+	ctx->trailsize = 0;
+
+	while (done < len && !ret) {
+		offs = (addr + done) & ~PAGE_MASK;
+		nr = min_t(size_t, DIV_ROUND_UP(offs + len - done, PAGE_SIZE),
+				VTUNERC_PIN_CHUNK);
+
+		pinned = get_user_pages_fast((addr + done) & PAGE_MASK, nr, 0,
+						pages);
+		if (pinned <= 0) {
+			printk(KERN_ERR "vtunerc%d: userdata passing error\n",
+					ctx->idx);
+			ret = -EINVAL;
+			break;
+		}
+
+		for (i = 0, n = 0; i < pinned; i++) {
+			seg = min_t(size_t, PAGE_SIZE - offs, len - done - n);
+			va = kmap(pages[i]);
+			memcpy(ctx->kernel_buf + n, va + offs, seg);
+			kunmap(pages[i]);
+			put_page(pages[i]);
+			n += seg;
+			offs = 0;
+		}
+
+		ret = vtunerc_ctrldev_demux_piece(ctx, ctx->kernel_buf, n);
+		if (!ret)
+			done += n;
+	}
+
+	/* packet left half in trail was not consumed */
+	done -= ctx->trailsize;
+	ctx->trailsize = 0;
+
+	return done ? done : ret;
+}
+
+/*
+ * interarrival jitter of 192 byte packets against the local clock,
+ * estimated as RFC 3550 does; p is the last packet of a batch
+ */
+static void vtunerc_ctrldev_stamp(struct vtunerc_ctx *ctx, const u8 *p)
+{
+	u32 stamp = ((p[0] & 0x3f) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	u64 now = ktime_to_ns(ktime_get());
+	s64 d;
+
+	if (ctx->stamp_valid) {
+		/* 27 MHz ticks, the counter wraps at 30 bits */
+		d = (s64)(now - ctx->stamp_ns) - (s64)div_u64(
+			(u64)((stamp - ctx->stamp) & 0x3fffffff) * 1000, 27);
+		if (d < 0)
+			d = -d;
+		ctx->stamp_jitter += (d - ctx->stamp_jitter) / 16;
+	}
+
+	ctx->stamp = stamp;
+	ctx->stamp_ns = now;
+	ctx->stamp_valid = 1;
+}
+
+/*
+ * demux len bytes of packets in the configured format, converted
+ * to 188 byte ones in place; caller holds tswrite_sem.
+ * Called once per write() or iovec, the capture is taken here.
+ */
+static int vtunerc_ctrldev_demux_fmt(struct vtunerc_ctx *ctx, u8 *buf,
+					size_t len)
+{
+	size_t count = len / ctx->pktsize;
+
+	if (ctx->pktsize != 188) {
+		if (ctx->pktsize == VTUNER_PKTFMT_192)
+			vtunerc_ctrldev_stamp(ctx, buf + (count - 1) * 192);
+		vtunerc_ts_strip(buf, count, ctx->pktsize);
+	}
+
+	if (unlikely(ctx->capture))
+		vtunerc_capture_ts(ctx, buf, count * 188);
+
+	return vtunerc_ctrldev_demux(ctx, buf, count * 188);
+}
+
 static ssize_t vtunerc_ctrldev_write(struct file *filp, const char *buff,
 					size_t len, loff_t *off)
 {
 	struct vtunerc_ctx *ctx = filp->private_data;
-	struct dvb_demux *demux = &ctx->demux;
-	int tailsize = len % 188;
+	int ret;
 
 	if (ctx->closing)
 		return -EINTR;
 
-	if (len < 188) {
-		printk(KERN_ERR "vtunerc%d: Data are shorter then TS packet size (188B)\n",
-				ctx->idx);
+	ret = vtunerc_ctrldev_tswrite_lock(ctx, filp);
+	if (ret)
+		return ret;
+
+	if (len < ctx->pktsize) {
+		printk(KERN_ERR "vtunerc%d: Data are shorter then TS packet size (%uB)\n",
+				ctx->idx, ctx->pktsize);
+		vtunerc_ctrldev_tswrite_unlock(ctx);
 		return -EINVAL;
 	}
 
-	len -= tailsize;
-
-	// new buffer need to be allocated ?
-	if ((ctx->kernel_buf == NULL) || (len > ctx->kernel_buf_size)) {
-		// free old buffer
-		if (ctx->kernel_buf) {
-			kfree(ctx->kernel_buf);
-			ctx->kernel_buf = NULL;
-			ctx->kernel_buf_size = 0;
-		}
-		// allocate a bigger buffer
-		ctx->kernel_buf = kmalloc(len, GFP_KERNEL);
-		if (!ctx->kernel_buf) {
-			printk(KERN_ERR "vtunerc%d: unable to allocate buffer of %Zu bytes\n", ctx->idx, len);
-			return -ENOMEM;
-		}
-		ctx->kernel_buf_size = len;
-		printk(KERN_INFO "vtunerc%d: allocated buffer of %Zu bytes\n", ctx->idx, len);
+	len -= len % ctx->pktsize;
+
+	/*
+	 * other formats need the copy to drop the extra bytes anyway,
+	 * a capture copies the whole write too
+	 */
+	if (ctx->config->pinthreshold && len >= ctx->config->pinthreshold &&
+			ctx->pktsize == 188 && !ctx->capture) {
+		ret = vtunerc_ctrldev_write_pinned(ctx, buff, len);
+		vtunerc_ctrldev_tswrite_unlock(ctx);
+		return ret;
 	}
 
-	if (down_interruptible(&ctx->tswrite_sem)) {
-		return -ERESTARTSYS;
+	// new buffer need to be allocated ?
+	ret = vtunerc_ctrldev_alloc_buf(ctx, len);
+	if (ret) {
+		vtunerc_ctrldev_tswrite_unlock(ctx);
+		return ret;
 	}
 
 	if (copy_from_user(ctx->kernel_buf, buff, len)) {
 		printk(KERN_ERR "vtunerc%d: userdata passing error\n",
 				ctx->idx);
-		up(&ctx->tswrite_sem);
+		vtunerc_ctrldev_tswrite_unlock(ctx);
 		return -EINVAL;
 	}
 
-	if (ctx->config->tscheck) {
-		int i;
+	ret = vtunerc_ctrldev_demux_fmt(ctx, ctx->kernel_buf, len);
 
-		for (i = 0; i < len; i += 188)
-			if (ctx->kernel_buf[i] != 0x47) { /* start of TS packet */
-				printk(KERN_ERR "vtunerc%d: Data not start on packet boundary: index=%d data=%02x %02x %02x %02x %02x ...\n",
-						ctx->idx, i / 188, ctx->kernel_buf[i], ctx->kernel_buf[i + 1],
-						ctx->kernel_buf[i + 2], ctx->kernel_buf[i + 3], ctx->kernel_buf[i + 4]);
-				up(&ctx->tswrite_sem);
-				return -EINVAL;
-			}
+	vtunerc_ctrldev_tswrite_unlock(ctx);
+
+	return ret ? ret : len;
+}
+
+/* feed whole packets from a kernel buffer, used by in-kernel sources */
+int vtunerc_ctrldev_ingest(struct vtunerc_ctx *ctx, const u8 *buf, size_t len,
+				int cut)
+{
+	struct vtunerc_ts_stats st;
+	int ret = 0;
+
+	if (down_interruptible(&ctx->tswrite_sem))
+		return -ERESTARTSYS;
+	ctx->tswrite_busy = 1;
+	smp_wmb();
+
+	/* the stats are published under tswrite_sem */
+	if (cut) {
+		memset(&st, 0, sizeof(st));
+		st.drop_short = cut;
+		vtunerc_stats_ts(ctx, &st);
 	}
 
-	ctx->stat_wr_data += len;
-	dvb_dmx_swfilter_packets(demux, ctx->kernel_buf, len / 188);
+	if (len && unlikely(ctx->capture))
+		vtunerc_capture_ts(ctx, buf, len);
 
-	up(&ctx->tswrite_sem);
+	if (len)
+		ret = vtunerc_ctrldev_demux(ctx, buf, len);
+
+	vtunerc_ctrldev_tswrite_unlock(ctx);
+
+	return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+/*
+ * writev() path: every iovec is handled like a separate write(),
+ * so sync checking and the dropped tail follow its own packet boundaries.
+ * Empty iovecs are skipped. We stop after the first iovec which leaves
+ * a tail, the caller resubmits the rest as it does on short write().
+ */
+static ssize_t vtunerc_ctrldev_write_iter(struct kiocb *iocb,
+					struct iov_iter *from)
+{
+	struct vtunerc_ctx *ctx = iocb->ki_filp->private_data;
+	size_t seglen, len, done = 0;
+	int ret = 0;
+
+	if (ctx->closing)
+		return -EINTR;
+
+	ret = vtunerc_ctrldev_tswrite_lock(ctx, iocb->ki_filp);
+	if (ret)
+		return ret;
 
-#ifdef CONFIG_PROC_FS
-	/* TODO:  analyze injected data for statistics */
+	while (iov_iter_count(from)) {
+		seglen = iov_iter_single_seg_count(from);
+		if (seglen == 0) {
+			/* empty iovec, steps to the next one */
+			iov_iter_advance(from, 0);
+			continue;
+		}
+		len = seglen - seglen % ctx->pktsize;
+		if (len == 0)
+			break;
+
+		ret = vtunerc_ctrldev_alloc_buf(ctx, len);
+		if (ret)
+			break;
+
+		if (copy_from_iter(ctx->kernel_buf, len, from) != len) {
+			printk(KERN_ERR "vtunerc%d: userdata passing error\n",
+					ctx->idx);
+			ret = -EINVAL;
+			break;
+		}
+
+		ret = vtunerc_ctrldev_demux_fmt(ctx, ctx->kernel_buf, len);
+		if (ret)
+			break;
+
+		done += len;
+		if (len != seglen)
+			break;
+	}
+
+	vtunerc_ctrldev_tswrite_unlock(ctx);
+
+	if (done)
+		return done;
+
+	if (ret)
+		return ret;
+
+	printk(KERN_ERR "vtunerc%d: Data are shorter then TS packet size (%uB)\n",
+			ctx->idx, ctx->pktsize);
+	return -EINVAL;
+}
 #endif
 
-	return len;
+/* queue request for the daemon, -EAGAIN when the queue is full */
+static int vtunerc_ctrldev_reqq_put(struct vtunerc_ctx *ctx,
+					struct vtuner_message *msg, u16 flags)
+{
+	struct vtunerc_req *req;
+	int ret = -EAGAIN;
+
+	spin_lock(&ctx->ctrldev_lock);
+	if (ctx->ctrldev_reqq_head - ctx->ctrldev_reqq_tail < VTUNERC_CTRLDEV_QLEN) {
+		req = &ctx->ctrldev_reqq[ctx->ctrldev_reqq_head % VTUNERC_CTRLDEV_QLEN];
+		req->seq = ++ctx->ctrldev_seq;
+		req->flags = flags;
+		memcpy(&req->msg, msg, VTUNER_MSG_LEN);
+		if (flags & VTUNER_MSGF_RESPONSE)
+			ctx->ctrldev_wait_seq = req->seq;
+		ctx->ctrldev_reqq_head++;
+		trace_vtunerc_msg_queue(ctx->idx, msg->type, req->seq);
+		ret = 0;
+	}
+	spin_unlock(&ctx->ctrldev_lock);
+
+	return ret;
+}
+
+/* fetch the oldest queued request, -EAGAIN when there is none */
+static int vtunerc_ctrldev_reqq_get(struct vtunerc_ctx *ctx,
+					struct vtunerc_req *req)
+{
+	int ret = -EAGAIN;
+
+	spin_lock(&ctx->ctrldev_lock);
+	if (ctx->ctrldev_reqq_head != ctx->ctrldev_reqq_tail) {
+		memcpy(req, &ctx->ctrldev_reqq[ctx->ctrldev_reqq_tail % VTUNERC_CTRLDEV_QLEN],
+				sizeof(*req));
+		ctx->ctrldev_reqq_tail++;
+		trace_vtunerc_msg_pickup(ctx->idx, req->msg.type, req->seq);
+		ret = 0;
+	}
+	spin_unlock(&ctx->ctrldev_lock);
+
+	return ret;
 }
 
+/*
+ * the waiter for request 'seq' was interrupted: take the request back
+ * when it is still queued, otherwise remember that the daemon owes a
+ * response nobody waits for - legacy responses carry no seq, the next
+ * one is its and gets dropped
+ */
+static void vtunerc_ctrldev_reqq_cancel(struct vtunerc_ctx *ctx, u32 seq)
+{
+	unsigned int i;
+
+	spin_lock(&ctx->ctrldev_lock);
+	for (i = ctx->ctrldev_reqq_tail; i != ctx->ctrldev_reqq_head; i++)
+		if (ctx->ctrldev_reqq[i % VTUNERC_CTRLDEV_QLEN].seq == seq)
+			break;
+	if (i != ctx->ctrldev_reqq_head) {
+		for (; i + 1 != ctx->ctrldev_reqq_head; i++)
+			memcpy(&ctx->ctrldev_reqq[i % VTUNERC_CTRLDEV_QLEN],
+				&ctx->ctrldev_reqq[(i + 1) % VTUNERC_CTRLDEV_QLEN],
+				sizeof(struct vtunerc_req));
+		ctx->ctrldev_reqq_head--;
+	} else if (!(ctx->proto_caps & VTUNER_CAP_FRAMED)) {
+		ctx->ctrldev_orphans++;
+	}
+	ctx->ctrldev_wait_seq = 0;
+	spin_unlock(&ctx->ctrldev_lock);
+
+	wake_up_interruptible(&ctx->ctrldev_wait_space_wq);
+}
+
+/*
+ * hand the response to its waiter, caller holds ctrldev_lock and
+ * checked it is wanted; the type goes last, the waiter tests it
+ */
+static void vtunerc_ctrldev_post_response(struct vtunerc_ctx *ctx,
+					const struct vtuner_message *msg)
+{
+	memcpy(&ctx->ctrldev_response.body, &msg->body,
+			sizeof(msg->body));
+	smp_wmb();
+	WRITE_ONCE(ctx->ctrldev_response.type, msg->type);
+}
+
+/* legacy response, dropped when its request is gone */
+static int vtunerc_ctrldev_set_response(struct vtunerc_ctx *ctx,
+					const char __user *arg)
+{
+	struct vtuner_message msg;
+	int drop;
+
+	if (copy_from_user(&msg, arg, VTUNER_MSG_LEN))
+		return -EFAULT;
+
+	spin_lock(&ctx->ctrldev_lock);
+	drop = ctx->ctrldev_orphans || !ctx->ctrldev_wait_seq ||
+			ctx->ctrldev_response.type != -1;
+	if (ctx->ctrldev_orphans)
+		ctx->ctrldev_orphans--;
+	if (!drop)
+		vtunerc_ctrldev_post_response(ctx, &msg);
+	spin_unlock(&ctx->ctrldev_lock);
+
+	if (drop) {
+		dprintk(ctx, "orphan response type=%d dropped\n", msg.type);
+		return 0;
+	}
+
+	wake_up_interruptible(&ctx->ctrldev_wait_response_wq);
+
+	return 0;
+}
+
+static int vtunerc_ctrldev_reqq_empty(struct vtunerc_ctx *ctx)
+{
+	return ctx->ctrldev_reqq_head == ctx->ctrldev_reqq_tail;
+}
+
+/* wait for (and dequeue) the next request */
+static int vtunerc_ctrldev_wait_request(struct vtunerc_ctx *ctx,
+					struct file *filp,
+					struct vtunerc_req *req)
+{
+	if (filp->f_flags & O_NONBLOCK) {
+		if (vtunerc_ctrldev_reqq_get(ctx, req))
+			return -EAGAIN;
+	} else if (wait_event_interruptible(ctx->ctrldev_wait_request_wq,
+				!vtunerc_ctrldev_reqq_get(ctx, req)))
+		return -ERESTARTSYS;
+
+	wake_up_interruptible(&ctx->ctrldev_wait_space_wq);
+
+	return 0;
+}
+
+/*
+ * read() returns queued requests, as many as are pending and fit
+ * in the buffer: struct vtuner_message each, or framed records
+ * when VTUNER_CAP_FRAMED was negotiated
+ */
 static ssize_t vtunerc_ctrldev_read(struct file *filp, char __user *buff,
 		size_t len, loff_t *off)
+{
+	struct vtunerc_ctx *ctx = filp->private_data;
+	int framed = ctx->proto_caps & VTUNER_CAP_FRAMED;
+	size_t reclen = framed ? VTUNER_MSG_MAXREC : VTUNER_MSG_LEN;
+	u8 rec[VTUNER_MSG_MAXREC];
+	struct vtunerc_req req;
+	size_t done = 0;
+	int ret;
+
+	if (ctx->closing)
+		return -EINTR;
+
+	if (len < reclen)
+		return -EINVAL;
+
+	ret = vtunerc_ctrldev_wait_request(ctx, filp, &req);
+	if (ret)
+		return ret;
+
+	do {
+		if (framed) {
+			ret = vtunerc_proto_encode(&req.msg, req.seq, req.flags,
+							rec, sizeof(rec));
+			if (ret < 0)
+				break;
+			if (copy_to_user(buff + done, rec, ret)) {
+				ret = -EFAULT;
+				break;
+			}
+			done += ret;
+		} else {
+			if (copy_to_user(buff + done, &req.msg, VTUNER_MSG_LEN)) {
+				ret = -EFAULT;
+				break;
+			}
+			done += VTUNER_MSG_LEN;
+		}
+	} while (done + reclen <= len &&
+			!vtunerc_ctrldev_reqq_get(ctx, &req));
+
+	wake_up_interruptible(&ctx->ctrldev_wait_space_wq);
+
+	vtunerc_stats_read(ctx, done);
+
+	return done ? done : ret;
+}
+
+/* framed response, dropped unless it answers the pending request */
+static int vtunerc_ctrldev_set_response_framed(struct vtunerc_ctx *ctx,
+					const char __user *arg)
+{
+	u8 rec[VTUNER_MSG_MAXREC];
+	struct vtuner_msg_hdr *hdr = (struct vtuner_msg_hdr *)rec;
+	struct vtuner_message msg;
+	u32 seq;
+	u16 flags;
+	int ret;
+
+	if (copy_from_user(hdr, arg, sizeof(*hdr)))
+		return -EFAULT;
+
+	if (hdr->len > sizeof(msg.body))
+		return -EINVAL;
+
+	if (copy_from_user(hdr + 1, arg + sizeof(*hdr), hdr->len))
+		return -EFAULT;
+
+	ret = vtunerc_proto_decode(rec, sizeof(*hdr) + hdr->len, &msg, &seq,
+					&flags);
+	if (ret < 0)
+		return ret;
+
+	/* the waiter may give up meanwhile, it clears wait_seq under the lock */
+	spin_lock(&ctx->ctrldev_lock);
+	if (seq != ctx->ctrldev_wait_seq || ctx->ctrldev_response.type != -1) {
+		spin_unlock(&ctx->ctrldev_lock);
+		dprintk(ctx, "stale response seq=%u dropped\n", seq);
+		return 0;
+	}
+	vtunerc_ctrldev_post_response(ctx, &msg);
+	spin_unlock(&ctx->ctrldev_lock);
+
+	wake_up_interruptible(&ctx->ctrldev_wait_response_wq);
+
+	return 0;
+}
+
+/*
+ * shared-memory mailbox
+ *
+ * The indices we own are kept in ctx, so a misbehaving daemon
+ * can only confuse itself. The mailbox memory stays allocated
+ * until module unload, only mbox_on is switched.
+ */
+
+static int vtunerc_ctrldev_mbox_set(struct vtunerc_ctx *ctx, int fd)
+{
+	struct eventfd_ctx *efd = NULL, *old;
+
+	if (fd >= 0) {
+		efd = eventfd_ctx_fdget(fd);
+		if (IS_ERR(efd))
+			return PTR_ERR(efd);
+
+		if (!ctx->mbox)
+			ctx->mbox = vmalloc_user(sizeof(struct vtuner_mbox));
+		if (!ctx->mbox) {
+			printk(KERN_ERR "vtunerc%d: no memory for mailbox\n",
+					ctx->idx);
+			eventfd_ctx_put(efd);
+			return -ENOMEM;
+		}
+	}
+
+	/*
+	 * no response waiter may see the indices reset; switching off
+	 * comes from release too, a dying daemon must not skip it
+	 */
+	if (!efd) {
+		down(&ctx->xchange_sem);
+	} else if (down_interruptible(&ctx->xchange_sem)) {
+		eventfd_ctx_put(efd);
+		return -ERESTARTSYS;
+	}
+
+	spin_lock(&ctx->ctrldev_lock);
+	old = ctx->mbox_efd;
+	ctx->mbox_efd = efd;
+	ctx->mbox_on = efd != NULL;
+	if (ctx->mbox_on) {
+		memset(ctx->mbox, 0, sizeof(struct vtuner_mbox));
+		ctx->mbox->version = VTUNER_MBOX_VERSION;
+		ctx->mbox->kernel_waits = ctx->mbox_waiters > 0;
+		ctx->mbox_req_head = 0;
+		ctx->mbox_rsp_tail = 0;
+	}
+	spin_unlock(&ctx->ctrldev_lock);
+
+	up(&ctx->xchange_sem);
+
+	if (old)
+		eventfd_ctx_put(old);
+
+	/* waiters bail out when the mailbox is switched off */
+	wake_up_interruptible(&ctx->mbox_wq);
+
+	return 0;
+}
+
+/*
+ * queue request, -EAGAIN when full, -ENOTCONN when nobody listens;
+ * *seq gets its seq, the daemon picked it up once req.tail reaches it
+ */
+static int vtunerc_ctrldev_mbox_put(struct vtunerc_ctx *ctx,
+					struct vtuner_message *msg, u32 *seq)
+{
+	struct vtuner_mbox_ring *r;
+	int ret = -EAGAIN;
+
+	spin_lock(&ctx->ctrldev_lock);
+	if (!ctx->mbox_on || ctx->fd_opened < 1) {
+		ret = -ENOTCONN;
+	} else {
+		r = &ctx->mbox->req;
+		if (ctx->mbox_req_head - READ_ONCE(r->tail) < VTUNER_MBOX_SLOTS) {
+			memcpy(&r->msg[ctx->mbox_req_head % VTUNER_MBOX_SLOTS],
+					msg, VTUNER_MSG_LEN);
+			*seq = ++ctx->mbox_req_head;
+			trace_vtunerc_msg_queue(ctx->idx, msg->type, *seq);
+			smp_wmb();
+			WRITE_ONCE(r->head, ctx->mbox_req_head);
+			smp_mb();
+			if (READ_ONCE(ctx->mbox->daemon_waits))
+				eventfd_signal(ctx->mbox_efd, 1);
+			ret = 0;
+		}
+	}
+	spin_unlock(&ctx->ctrldev_lock);
+
+	return ret;
+}
+
+/*
+ * fetch response, -EAGAIN when none, -ENOTCONN when nobody listens;
+ * msg holds the request until then, its pickup is traced once
+ * req.tail reached *seq, which is cleared then
+ */
+static int vtunerc_ctrldev_mbox_get(struct vtunerc_ctx *ctx,
+					struct vtuner_message *msg, u32 *seq)
+{
+	struct vtuner_mbox_ring *r;
+	int ret = -EAGAIN;
+
+	spin_lock(&ctx->ctrldev_lock);
+	if (!ctx->mbox_on || ctx->fd_opened < 1) {
+		ret = -ENOTCONN;
+	} else {
+		if (*seq && (s32)(READ_ONCE(ctx->mbox->req.tail) - *seq) >= 0) {
+			trace_vtunerc_msg_pickup(ctx->idx, msg->type, *seq);
+			*seq = 0;
+		}
+		r = &ctx->mbox->rsp;
+		if (READ_ONCE(r->head) != ctx->mbox_rsp_tail) {
+			smp_rmb();
+			memcpy(msg, &r->msg[ctx->mbox_rsp_tail % VTUNER_MBOX_SLOTS],
+					VTUNER_MSG_LEN);
+			ctx->mbox_rsp_tail++;
+			smp_mb();
+			WRITE_ONCE(r->tail, ctx->mbox_rsp_tail);
+			ret = 0;
+		}
+	}
+	spin_unlock(&ctx->ctrldev_lock);
+
+	return ret;
+}
+
+/* drop responses left over from interrupted exchanges */
+static void vtunerc_ctrldev_mbox_flush(struct vtunerc_ctx *ctx)
+{
+	spin_lock(&ctx->ctrldev_lock);
+	if (ctx->mbox_on) {
+		ctx->mbox_rsp_tail = READ_ONCE(ctx->mbox->rsp.head);
+		WRITE_ONCE(ctx->mbox->rsp.tail, ctx->mbox_rsp_tail);
+	}
+	spin_unlock(&ctx->ctrldev_lock);
+}
+
+/* busy-poll for mboxspin us, then sleep until kicked or timeout */
+static int vtunerc_ctrldev_mbox_wait(struct vtunerc_ctx *ctx,
+		int (*try)(struct vtunerc_ctx *, struct vtuner_message *, u32 *),
+		struct vtuner_message *msg, u32 *seq, long timeout)
+{
+	s64 end;
+	long t;
+	int ret;
+
+	ret = try(ctx, msg, seq);
+	if (ret != -EAGAIN)
+		return ret;
+
+	if (ctx->config->mboxspin > 0) {
+		end = ktime_to_ns(ktime_get()) + ctx->config->mboxspin * 1000LL;
+		while ((ret = try(ctx, msg, seq)) == -EAGAIN &&
+				ktime_to_ns(ktime_get()) < end)
+			cpu_relax();
+		if (ret != -EAGAIN)
+			return ret;
+	}
+
+	spin_lock(&ctx->ctrldev_lock);
+	if (ctx->mbox_waiters++ == 0 && ctx->mbox_on)
+		WRITE_ONCE(ctx->mbox->kernel_waits, 1);
+	spin_unlock(&ctx->ctrldev_lock);
+	smp_mb();
+
+	t = wait_event_interruptible_timeout(ctx->mbox_wq,
+				(ret = try(ctx, msg, seq)) != -EAGAIN, timeout);
+	if (t <= 0)
+		ret = t ? -ERESTARTSYS : -ETIMEDOUT;
+
+	spin_lock(&ctx->ctrldev_lock);
+	if (--ctx->mbox_waiters == 0 && ctx->mbox_on)
+		WRITE_ONCE(ctx->mbox->kernel_waits, 0);
+	spin_unlock(&ctx->ctrldev_lock);
+
+	return ret;
+}
+
+/* only one request waits for response at the time */
+static int vtunerc_ctrldev_xchange_lock(struct vtunerc_ctx *ctx, long timeout)
+{
+	if (timeout == MAX_SCHEDULE_TIMEOUT)
+		return down_interruptible(&ctx->xchange_sem) ? -ERESTARTSYS : 0;
+
+	return down_timeout(&ctx->xchange_sem, timeout) ? -ETIMEDOUT : 0;
+}
+
+/* *seq gets the seq of the request */
+static int vtunerc_ctrldev_mbox_xchange(struct vtunerc_ctx *ctx,
+		struct vtuner_message *msg, int wait4response, u32 *seq,
+		long timeout)
+{
+	u32 pick;
+	int ret;
+
+	*seq = 0;
+
+	if (!wait4response) {
+		ret = vtunerc_ctrldev_mbox_wait(ctx, vtunerc_ctrldev_mbox_put,
+						msg, seq, timeout);
+		return ret == -ENOTCONN ? 0 : ret;
+	}
+
+	ret = vtunerc_ctrldev_xchange_lock(ctx, timeout);
+	if (ret)
+		return ret;
+
+	vtunerc_ctrldev_mbox_flush(ctx);
+
+	ret = vtunerc_ctrldev_mbox_wait(ctx, vtunerc_ctrldev_mbox_put, msg, seq,
+					timeout);
+	if (!ret) {
+		pick = *seq;
+		ret = vtunerc_ctrldev_mbox_wait(ctx, vtunerc_ctrldev_mbox_get,
+						msg, &pick, timeout);
+	}
+
+	up(&ctx->xchange_sem);
+
+	/* no response came */
+	if (ret == -ENOTCONN) {
+		*seq = 0;
+		return 0;
+	}
+
+	return ret;
+}
+
+static int vtunerc_ctrldev_mmap(struct file *filp, struct vm_area_struct *vma)
 {
 	struct vtunerc_ctx *ctx = filp->private_data;
 
-	ctx->stat_rd_data += len;
+	if (!ctx->mbox || vma->vm_pgoff)
+		return -EINVAL;
 
-	/* read op is not using in current vtuner protocol */
-	return 0 ;
+	return remap_vmalloc_range(vma, ctx->mbox, 0);
 }
 
 static int vtunerc_ctrldev_open(struct inode *inode, struct file *filp)
@@ -125,11 +1121,13 @@ static int vtunerc_ctrldev_open(struct inode *inode, struct file *filp)
 
 	ctx->stat_ctrl_sess++;
 
-	/*FIXME: clear pidtab */
-
 	ctx->fd_opened++;
 	ctx->closing = 0;
 
+	/* bring a new daemon up to date once it set the type */
+	if (ctx->fd_opened == 1)
+		vtunerc_resume_connect(ctx);
+
 	return 0;
 }
 
@@ -152,13 +1150,28 @@ static int vtunerc_ctrldev_close(struct inode *inode, struct file *filp)
 	dprintk(ctx, "faked response\n");
 	wake_up_interruptible(&ctx->ctrldev_wait_response_wq);
 
+	/* nobody left to pick up queued requests */
+	if (ctx->fd_opened < 1) {
+		spin_lock(&ctx->ctrldev_lock);
+		ctx->ctrldev_reqq_tail = ctx->ctrldev_reqq_head;
+		ctx->ctrldev_orphans = 0;
+		spin_unlock(&ctx->ctrldev_lock);
+		wake_up_interruptible(&ctx->mbox_wq);
+		vtunerc_ctrldev_mbox_set(ctx, -1);
+		ctx->proto_version = 0;
+		ctx->proto_caps = 0;
+		bitmap_zero(ctx->secmap, 0x2000);
+		ctx->pktsize = VTUNER_PKTFMT_188;
+		vtunerc_sock_stop(ctx);
+		vtunerc_resume_disconnect(ctx);
+		vtunerc_ca_disconnect(ctx);
+	}
+	wake_up_interruptible(&ctx->ctrldev_wait_space_wq);
+
 	/* clear pidtab */
 	dprintk(ctx, "sending pidtab cleared ...\n");
-	if (down_interruptible(&ctx->xchange_sem))
-		return -ERESTARTSYS;
 	memset(&fakemsg, 0, sizeof(fakemsg));
 	vtunerc_ctrldev_xchange_message(ctx, &fakemsg, 0);
-	up(&ctx->xchange_sem);
 	dprintk(ctx, "pidtab clearing done\n");
 
 	return 0;
@@ -168,11 +1181,17 @@ static long vtunerc_ctrldev_ioctl(struct file *file, unsigned int cmd,
 					unsigned long arg)
 {
 	struct vtunerc_ctx *ctx = file->private_data;
+	struct vtunerc_req req;
+	struct vtuner_message msg;
 	int len, i, vtype, ret = 0;
 
 	if (ctx->closing)
 		return -EINTR;
 
+	/* CA traffic doesn't wait for the frontend requests */
+	if (cmd == VTUNER_SET_CA_INFO || cmd == VTUNER_GET_CA_MESSAGE)
+		return vtunerc_ca_ctrldev_ioctl(ctx, file, cmd, arg);
+
 	if (down_interruptible(&ctx->ioctl_sem))
 		return -ERESTARTSYS;
 
@@ -241,6 +1260,7 @@ static long vtunerc_ctrldev_ioctl(struct file *file, unsigned int cmd,
 			break;
 		}
 
+		vtunerc_resume_start(ctx);
 		break;
 
 
@@ -262,35 +1282,94 @@ static long vtunerc_ctrldev_ioctl(struct file *file, unsigned int cmd,
 
 	case VTUNER_GET_MESSAGE:
 		dprintk(ctx, "msg VTUNER_GET_MESSAGE\n");
-		if (wait_event_interruptible(ctx->ctrldev_wait_request_wq,
-					ctx->ctrldev_request.type != -1)) {
-			ret = -ERESTARTSYS;
+		ret = vtunerc_ctrldev_wait_request(ctx, file, &req);
+		if (ret)
+			break;
+
+		if (copy_to_user((char *)arg, &req.msg, VTUNER_MSG_LEN)) {
+			ret = -EFAULT;
 			break;
 		}
 
-		BUG_ON(ctx->ctrldev_request.type == -1);
+		break;
 
-		if (copy_to_user((char *)arg, &ctx->ctrldev_request,
-					VTUNER_MSG_LEN)) {
+	case VTUNER_SET_RESPONSE:
+		dprintk(ctx, "msg VTUNER_SET_RESPONSE\n");
+		ret = vtunerc_ctrldev_set_response(ctx, (char *)arg);
+		break;
+
+	case VTUNER_SET_RESPONSE_FRAMED:
+		dprintk(ctx, "msg VTUNER_SET_RESPONSE_FRAMED\n");
+		ret = vtunerc_ctrldev_set_response_framed(ctx, (char *)arg);
+		break;
+
+	case VTUNER_DISCOVER:
+		dprintk(ctx, "msg VTUNER_DISCOVER\n");
+		if (copy_from_user(&msg, (char *)arg, VTUNER_MSG_LEN)) {
 			ret = -EFAULT;
 			break;
 		}
+		if (msg.type != MSG_DISCOVER || msg.body.discover.version < 2) {
+			ret = -EINVAL;
+			break;
+		}
+		ctx->proto_version = min_t(u32, msg.body.discover.version,
+						VTUNER_PROTO_VERSION);
+		ctx->proto_caps = msg.body.discover.caps & VTUNERC_CAPS;
+		msg.body.discover.version = ctx->proto_version;
+		msg.body.discover.caps = ctx->proto_caps;
+		printk(KERN_NOTICE "vtunerc%d: protocol version %u, caps 0x%x\n",
+				ctx->idx, ctx->proto_version, ctx->proto_caps);
+		if (copy_to_user((char *)arg, &msg, VTUNER_MSG_LEN))
+			ret = -EFAULT;
+		break;
 
-		ctx->ctrldev_request.type = -1;
+	case VTUNER_SET_TS_SOCKET:
+		dprintk(ctx, "msg VTUNER_SET_TS_SOCKET\n");
+		ret = vtunerc_sock_start(ctx, (int) arg);
+		break;
 
-		if (ctx->noresponse)
-			up(&ctx->xchange_sem);
+	case VTUNER_SET_DEJITTER: {
+		struct vtuner_dejitter dj;
 
+		dprintk(ctx, "msg VTUNER_SET_DEJITTER\n");
+		if (copy_from_user(&dj, (char *)arg, sizeof(dj))) {
+			ret = -EFAULT;
+			break;
+		}
+		if (down_interruptible(&ctx->tswrite_sem)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		ret = vtunerc_dejitter_set(ctx, &dj);
+		up(&ctx->tswrite_sem);
 		break;
+	}
 
-	case VTUNER_SET_RESPONSE:
-		dprintk(ctx, "msg VTUNER_SET_RESPONSE\n");
-		if (copy_from_user(&ctx->ctrldev_response, (char *)arg,
-					VTUNER_MSG_LEN)) {
-			ret = -EFAULT;
+	case VTUNER_SET_PKTFMT:
+		dprintk(ctx, "msg VTUNER_SET_PKTFMT\n");
+		if (arg != VTUNER_PKTFMT_188 && arg != VTUNER_PKTFMT_192 &&
+				arg != VTUNER_PKTFMT_204) {
+			ret = -EINVAL;
+			break;
 		}
-		wake_up_interruptible(&ctx->ctrldev_wait_response_wq);
+		if (down_interruptible(&ctx->tswrite_sem)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		ctx->pktsize = arg;
+		ctx->stamp_valid = 0;
+		ctx->stamp_jitter = 0;
+		up(&ctx->tswrite_sem);
+		break;
+
+	case VTUNER_SET_MBOX:
+		dprintk(ctx, "msg VTUNER_SET_MBOX\n");
+		ret = vtunerc_ctrldev_mbox_set(ctx, (int) arg);
+		break;
 
+	case VTUNER_MBOX_KICK:
+		wake_up_interruptible(&ctx->mbox_wq);
 		break;
 
 	case VTUNER_SET_NUM_MODES:
@@ -315,12 +1394,27 @@ static unsigned int vtunerc_ctrldev_poll(struct file *filp, poll_table *wait)
 	unsigned int mask = 0;
 
 	if (ctx->closing)
-		return -EINTR;
+		return POLLHUP;
 
 	poll_wait(filp, &ctx->ctrldev_wait_request_wq, wait);
-
-	if (ctx->ctrldev_request.type > -1) {
-		mask = POLLPRI;
+	poll_wait(filp, &ctx->ctrldev_wait_write_wq, wait);
+
+	/* control request pending */
+	if (!vtunerc_ctrldev_reqq_empty(ctx))
+		mask |= POLLPRI | POLLIN | POLLRDNORM;
+
+	/* CA message pending */
+	if (vtunerc_ca_pending(ctx))
+		mask |= POLLRDBAND;
+
+	/* TS ingest free and the demux output keeps up */
+	smp_rmb();
+	if (!ctx->tswrite_busy) {
+		if (!vtunerc_ctrldev_backlog(ctx))
+			mask |= POLLOUT | POLLWRNORM;
+		else
+			schedule_delayed_work(&ctx->backlog_work,
+						VTUNERC_BACKLOG_POLL);
 	}
 
 	return mask;
@@ -332,8 +1426,12 @@ static const struct file_operations vtunerc_ctrldev_fops = {
 	.owner = THIS_MODULE,
 	.unlocked_ioctl = vtunerc_ctrldev_ioctl,
 	.write = vtunerc_ctrldev_write,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+	.write_iter = vtunerc_ctrldev_write_iter,
+#endif
 	.read  = vtunerc_ctrldev_read,
 	.poll  = (void *) vtunerc_ctrldev_poll,
+	.mmap  = vtunerc_ctrldev_mmap,
 	.open  = vtunerc_ctrldev_open,
 	.release  = vtunerc_ctrldev_close
 };
@@ -401,51 +1499,106 @@ void vtunerc_unregister_ctrldev(struct vtunerc_config *config)
 }
 
 
-int vtunerc_ctrldev_xchange_message(struct vtunerc_ctx *ctx,
-		struct vtuner_message *msg, int wait4response)
+/*
+ * like vtunerc_ctrldev_xchange_message(), but each wait gives up with
+ * -ETIMEDOUT after 'timeout' jiffies: for senders no signal reaches
+ */
+int vtunerc_ctrldev_xchange_timeout(struct vtunerc_ctx *ctx,
+		struct vtuner_message *msg, int wait4response, long timeout)
 {
-	//dprintk(ctx, "XCH_MSG: %d: entered\n", msg->type);
-	if (down_interruptible(&ctx->xchange_sem))
-		return -ERESTARTSYS;
+	u32 capseq = 0, seq;
+	long t;
+	int ret;
 
-	if (ctx->fd_opened < 1) {
-		//dprintk(ctx, "XCH_MSG: %d: no fd\n", msg->type);
-		up(&ctx->xchange_sem);
+	if (ctx->fd_opened < 1)
 		return 0;
+
+	vtunerc_stats_msg(ctx, msg->type, 0);
+	if (unlikely(ctx->capture))
+		capseq = vtunerc_capture_msg(ctx, wait4response ?
+				VTUNER_CAPTURE_REQ : VTUNER_CAPTURE_NOTIFY,
+				0, msg);
+
+	if (ctx->mbox_on) {
+		ret = vtunerc_ctrldev_mbox_xchange(ctx, msg, wait4response,
+							&seq, timeout);
+		if (!ret && wait4response && seq) {
+			vtunerc_stats_msg(ctx, msg->type, 1);
+			trace_vtunerc_msg_response(ctx->idx, msg->type, seq);
+			if (unlikely(ctx->capture))
+				vtunerc_capture_msg(ctx, VTUNER_CAPTURE_RSP,
+							capseq, msg);
+		}
+		return ret;
 	}
-	//dprintk(ctx, "XCH_MSG: %d: continue\n", msg->type);
 
-#if 0
-	BUG_ON(ctx->ctrldev_request.type != -1);
-#else
-	if(ctx->ctrldev_request.type != -1)
-		printk(KERN_WARNING "vtunerc%d: orphan request detected, type %d\n", ctx->idx, ctx->ctrldev_request.type);
+	/* requests without response are only queued */
+	if (!wait4response) {
+		t = wait_event_interruptible_timeout(ctx->ctrldev_wait_space_wq,
+				(ret = vtunerc_ctrldev_reqq_put(ctx, msg, 0)) != -EAGAIN ||
+				ctx->fd_opened < 1, timeout);
+		if (t <= 0)
+			return t ? -ERESTARTSYS : -ETIMEDOUT;
+		if (!ret)
+			wake_up_interruptible(&ctx->ctrldev_wait_request_wq);
+		return 0;
+	}
 
-#endif
+	ret = vtunerc_ctrldev_xchange_lock(ctx, timeout);
+	if (ret)
+		return ret;
 
-	memcpy(&ctx->ctrldev_request, msg, sizeof(struct vtuner_message));
+	if (ctx->fd_opened < 1) {
+		up(&ctx->xchange_sem);
+		return 0;
+	}
 	ctx->ctrldev_response.type = -1;
-	ctx->noresponse = !wait4response;
-	wake_up_interruptible(&ctx->ctrldev_wait_request_wq);
 
-	if (!wait4response)
+	t = wait_event_interruptible_timeout(ctx->ctrldev_wait_space_wq,
+			(ret = vtunerc_ctrldev_reqq_put(ctx, msg,
+					VTUNER_MSGF_RESPONSE)) != -EAGAIN ||
+			ctx->fd_opened < 1, timeout);
+	if (t <= 0) {
+		up(&ctx->xchange_sem);
+		return t ? -ERESTARTSYS : -ETIMEDOUT;
+	}
+	if (ret) {
+		up(&ctx->xchange_sem);
 		return 0;
+	}
+	wake_up_interruptible(&ctx->ctrldev_wait_request_wq);
 
-	if (wait_event_interruptible(ctx->ctrldev_wait_response_wq,
-				ctx->ctrldev_response.type != -1)) {
-		//dprintk(ctx, "XCH_MSG: %d: wait_event interrupted\n", msg->type);
-		ctx->ctrldev_request.type = -1;
+	t = wait_event_interruptible_timeout(ctx->ctrldev_wait_response_wq,
+				ctx->ctrldev_response.type != -1, timeout);
+	if (t <= 0) {
+		vtunerc_ctrldev_reqq_cancel(ctx, ctx->ctrldev_wait_seq);
 		up(&ctx->xchange_sem);
-		return -ERESTARTSYS;
+		return t ? -ERESTARTSYS : -ETIMEDOUT;
 	}
 
 	BUG_ON(ctx->ctrldev_response.type == -1);
 
-	//dprintk(ctx, "XCH_MSG: %d -> %d (DONE)\n", msg->type, ctx->ctrldev_response.type);
+	/* pairs with vtunerc_ctrldev_post_response() */
+	smp_rmb();
 	memcpy(msg, &ctx->ctrldev_response, sizeof(struct vtuner_message));
+	trace_vtunerc_msg_response(ctx->idx, msg->type, ctx->ctrldev_wait_seq);
+	spin_lock(&ctx->ctrldev_lock);
+	ctx->ctrldev_wait_seq = 0;
+	spin_unlock(&ctx->ctrldev_lock);
 	ctx->ctrldev_response.type = -1;
 
 	up(&ctx->xchange_sem);
 
+	vtunerc_stats_msg(ctx, msg->type, 1);
+	if (unlikely(ctx->capture))
+		vtunerc_capture_msg(ctx, VTUNER_CAPTURE_RSP, capseq, msg);
+
 	return 0;
 }
+
+int vtunerc_ctrldev_xchange_message(struct vtunerc_ctx *ctx,
+		struct vtuner_message *msg, int wait4response)
+{
+	return vtunerc_ctrldev_xchange_timeout(ctx, msg, wait4response,
+						MAX_SCHEDULE_TIMEOUT);
+}
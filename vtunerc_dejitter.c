@@ -0,0 +1,399 @@
+/*
+ * vtunerc: PCR paced de-jitter buffer
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Injected packets are queued in a ring and released to the demux
+ * at the stream rate, which is measured from the PCR of one PID
+ * (chosen or the first one seen carrying PCR). A periodic hrtimer
+ * kicks a tasklet, which releases what the rate allows plus a bit
+ * when the buffer fills above the target latency.
+ *
+ * With nothing to release the tasklet marks the stage idle and the
+ * timer is not rearmed; the next put starts it again.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+
+#include "vtunerc_priv.h"
+
+#define DJ_TICK_NS		1000000		/* 1 ms */
+#define PCR_HZ			27000000ULL
+#define PCR_WRAP		(((1ULL << 33) * 300))
+#define PCR_MAX_GAP		(PCR_HZ / 2)	/* larger gap is discontinuity */
+#define JITTER_REBASE_NS	1000000000LL
+
+struct vtunerc_dejitter {
+	struct vtunerc_ctx *ctx;
+	spinlock_t lock;
+
+	u8 *buf;
+	unsigned int size;		/* in packets */
+	unsigned int head;		/* next to write */
+	unsigned int tail;		/* next to release */
+	unsigned int target;		/* fill to keep, in packets */
+	unsigned int latency_ms;
+
+	int pcr_auto;
+	u16 pcr_pid;
+	int have_pcr;
+	u64 last_pcr;
+	unsigned int pkts_since_pcr;
+	u32 rate;			/* packets per second */
+
+	int prebuffering;
+	ktime_t last_tick;
+	u64 credit;			/* packet-nanoseconds */
+
+	/* PCR vs. arrival */
+	int have_base;
+	u64 base_pcr;
+	ktime_t base_arrival;
+
+	struct hrtimer timer;
+	struct tasklet_struct tasklet;
+	int idle;			/* timer left unarmed */
+
+	/* statistics */
+	u64 stat_late;
+	u64 stat_overflow;
+	u32 stat_underruns;
+	u32 stat_jitter_max_us;
+	u32 stat_jitter_avg_us;
+};
+
+/* 27 MHz ticks from a to b, handling the wrap */
+static u64 pcr_delta(u64 a, u64 b)
+{
+	return b >= a ? b - a : b + PCR_WRAP - a;
+}
+
+static unsigned int dj_fill(struct vtunerc_dejitter *dj)
+{
+	return dj->head - dj->tail;
+}
+
+/* tell the write path about the fill, POLLOUT waits while 3/4 full */
+static void dj_backlog(struct vtunerc_dejitter *dj)
+{
+	struct vtunerc_ctx *ctx = dj->ctx;
+	int full = dj_fill(dj) > dj->size / 4 * 3;
+
+	if (full == ctx->dejitter_backlog)
+		return;
+
+	ctx->dejitter_backlog = full;
+	if (!full)
+		wake_up_interruptible(&ctx->ctrldev_wait_write_wq);
+}
+
+/* PCR in 27 MHz units, or -1 */
+static s64 dj_get_pcr(const u8 *p)
+{
+	u64 base;
+
+	if (!(p[3] & 0x20) || p[4] < 7 || !(p[5] & 0x10))
+		return -1;
+
+	base = ((u64)p[6] << 25) | (p[7] << 17) | (p[8] << 9) |
+		(p[9] << 1) | (p[10] >> 7);
+
+	return base * 300 + (((p[10] & 1) << 8) | p[11]);
+}
+
+static void dj_pcr_seen(struct vtunerc_dejitter *dj, u64 pcr, ktime_t now)
+{
+	u64 delta;
+	s64 diff;
+	u32 sample, absdiff;
+
+	if (dj->have_pcr) {
+		delta = pcr_delta(dj->last_pcr, pcr);
+		if (delta > 0 && delta < PCR_MAX_GAP) {
+			sample = div64_u64((u64)dj->pkts_since_pcr * PCR_HZ, delta);
+			/* moving average, 1/8 weight of the new sample */
+			dj->rate = dj->rate ? dj->rate - (dj->rate >> 3) + (sample >> 3)
+					: sample;
+		} else
+			dj->have_base = 0;
+	}
+
+	dj->have_pcr = 1;
+	dj->last_pcr = pcr;
+	dj->pkts_since_pcr = 0;
+
+	if (!dj->have_base) {
+		dj->have_base = 1;
+		dj->base_pcr = pcr;
+		dj->base_arrival = now;
+		return;
+	}
+
+	/* arrival time vs. the time the PCR says */
+	diff = ktime_to_ns(ktime_sub(now, dj->base_arrival)) -
+		(s64)div_u64(pcr_delta(dj->base_pcr, pcr) * 1000, 27);
+	if (diff > JITTER_REBASE_NS || diff < -JITTER_REBASE_NS) {
+		dj->have_base = 0;
+		return;
+	}
+
+	absdiff = div_u64(diff < 0 ? -diff : diff, 1000);
+	if (absdiff > dj->stat_jitter_max_us)
+		dj->stat_jitter_max_us = absdiff;
+	dj->stat_jitter_avg_us = dj->stat_jitter_avg_us -
+		(dj->stat_jitter_avg_us >> 4) + (absdiff >> 4);
+}
+
+/* queue whole packets, called from the write path */
+void vtunerc_dejitter_put(struct vtunerc_ctx *ctx, const u8 *buf, size_t len)
+{
+	struct vtunerc_dejitter *dj = ctx->dejitter;
+	ktime_t now = ktime_get();
+	unsigned int i, pid;
+	s64 pcr;
+
+	spin_lock_bh(&dj->lock);
+
+	if (dj_fill(dj) == 0 && !dj->prebuffering)
+		dj->stat_late += len / 188; /* output already ran dry */
+
+	for (i = 0; i < len; i += 188, buf += 188) {
+		pid = ((buf[1] & 0x1f) << 8) | buf[2];
+
+		if (dj->pcr_auto && !dj->have_pcr && dj_get_pcr(buf) >= 0)
+			dj->pcr_pid = pid;
+
+		if (pid == dj->pcr_pid) {
+			pcr = dj_get_pcr(buf);
+			if (pcr >= 0)
+				dj_pcr_seen(dj, pcr, now);
+		}
+		dj->pkts_since_pcr++;
+
+		if (dj_fill(dj) >= dj->size) {
+			dj->stat_overflow++;
+			continue;
+		}
+
+		memcpy(dj->buf + (dj->head % dj->size) * 188, buf, 188);
+		dj->head++;
+	}
+	dj_backlog(dj);
+
+	if (dj->idle) {
+		dj->idle = 0;
+		hrtimer_start(&dj->timer, ns_to_ktime(DJ_TICK_NS),
+				HRTIMER_MODE_REL);
+	}
+
+	spin_unlock_bh(&dj->lock);
+}
+
+static void dj_release(struct vtunerc_dejitter *dj, unsigned int n)
+{
+	unsigned int idx, run;
+
+	while (n) {
+		idx = dj->tail % dj->size;
+		run = min(n, dj->size - idx);
+		dvb_dmx_swfilter_packets(&dj->ctx->demux, dj->buf + idx * 188, run);
+		dj->tail += run;
+		n -= run;
+	}
+}
+
+static void dj_tasklet(unsigned long data)
+{
+	struct vtunerc_dejitter *dj = (struct vtunerc_dejitter *)data;
+	ktime_t now = ktime_get();
+	unsigned int fill, n;
+	u64 elapsed;
+
+	spin_lock(&dj->lock);
+
+	fill = dj_fill(dj);
+	if (dj->rate)
+		dj->target = min(dj->size / 2,
+				dj->rate / 1000 * dj->latency_ms + 1);
+
+	if (dj->prebuffering) {
+		if (fill < dj->target)
+			goto out;
+		dj->prebuffering = 0;
+		dj->last_tick = now;
+		dj->credit = 0;
+		goto out;
+	}
+
+	if (!dj->rate) {
+		/* no PCR seen yet, just pass through */
+		dj_release(dj, fill);
+		goto out;
+	}
+
+	elapsed = ktime_to_ns(ktime_sub(now, dj->last_tick));
+	dj->last_tick = now;
+	dj->credit += elapsed * dj->rate;
+	n = div64_u64(dj->credit, NSEC_PER_SEC);
+	dj->credit -= (u64)n * NSEC_PER_SEC;
+
+	/* drain slowly what is above the target */
+	if (fill > dj->target)
+		n += (fill - dj->target) >> 6;
+
+	if (n > fill) {
+		dj->stat_underruns++;
+		dj->prebuffering = 1;
+		n = fill;
+	}
+
+	dj_release(dj, n);
+out:
+	dj_backlog(dj);
+	fill = dj_fill(dj);
+	dj->idle = fill == 0 || (dj->prebuffering && fill < dj->target);
+	spin_unlock(&dj->lock);
+}
+
+static enum hrtimer_restart dj_timer(struct hrtimer *timer)
+{
+	struct vtunerc_dejitter *dj = container_of(timer,
+					struct vtunerc_dejitter, timer);
+
+	/* put rearms an idle timer */
+	if (dj->idle)
+		return HRTIMER_NORESTART;
+
+	tasklet_schedule(&dj->tasklet);
+	hrtimer_forward_now(timer, ns_to_ktime(DJ_TICK_NS));
+
+	return HRTIMER_RESTART;
+}
+
+static void vtunerc_dejitter_free(struct vtunerc_dejitter *dj)
+{
+	hrtimer_cancel(&dj->timer);
+	tasklet_kill(&dj->tasklet);
+
+	/* flush what is left */
+	spin_lock_bh(&dj->lock);
+	dj_release(dj, dj_fill(dj));
+	dj_backlog(dj);
+	spin_unlock_bh(&dj->lock);
+
+	vfree(dj->buf);
+	kfree(dj);
+}
+
+/* (re)configure, size 0 switches the stage off; caller holds tswrite_sem */
+int vtunerc_dejitter_set(struct vtunerc_ctx *ctx, struct vtuner_dejitter *cfg)
+{
+	struct vtunerc_dejitter *dj;
+
+	/* a bad config leaves the running stage alone */
+	if (cfg && cfg->size >= 188 &&
+			(cfg->size > VTUNER_DEJITTER_MAXSIZE ||
+			 cfg->latency_ms > VTUNER_DEJITTER_MAXLATENCY ||
+			 (cfg->pcr_pid != VTUNER_PCR_PID_AUTO &&
+			  cfg->pcr_pid > 0x1ffe)))
+		return -EINVAL;
+
+	if (ctx->dejitter) {
+		dj = ctx->dejitter;
+		ctx->dejitter = NULL;
+		vtunerc_dejitter_free(dj);
+	}
+
+	if (!cfg || cfg->size < 188)
+		return 0;
+
+	dj = kzalloc(sizeof(*dj), GFP_KERNEL);
+	if (!dj)
+		return -ENOMEM;
+
+	dj->size = cfg->size / 188;
+	dj->buf = vmalloc(dj->size * 188);
+	if (!dj->buf) {
+		kfree(dj);
+		return -ENOMEM;
+	}
+
+	dj->ctx = ctx;
+	spin_lock_init(&dj->lock);
+	dj->latency_ms = cfg->latency_ms;
+	dj->target = dj->size / 2;
+	dj->pcr_auto = cfg->pcr_pid == VTUNER_PCR_PID_AUTO;
+	dj->pcr_pid = dj->pcr_auto ? PID_UNKNOWN : cfg->pcr_pid;
+	dj->prebuffering = 1;
+
+	tasklet_init(&dj->tasklet, dj_tasklet, (unsigned long)dj);
+	hrtimer_init(&dj->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	dj->timer.function = dj_timer;
+
+	ctx->dejitter = dj;
+	hrtimer_start(&dj->timer, ns_to_ktime(DJ_TICK_NS), HRTIMER_MODE_REL);
+
+	printk(KERN_NOTICE "vtunerc%d: dejitter buffer %u packets, latency %u ms\n",
+			ctx->idx, dj->size, dj->latency_ms);
+
+	return 0;
+}
+
+/* tswrite_sem keeps VTUNER_SET_DEJITTER from freeing the stage */
+void vtunerc_dejitter_show(struct vtunerc_ctx *ctx, struct seq_file *m,
+				int raw)
+{
+	struct vtunerc_dejitter *dj;
+
+	if (down_interruptible(&ctx->tswrite_sem))
+		return;
+
+	dj = ctx->dejitter;
+	if (!dj)
+		goto out;
+
+	spin_lock_bh(&dj->lock);
+	if (raw) {
+		seq_printf(m, "dejitter_used %u\n", dj_fill(dj));
+		seq_printf(m, "dejitter_size %u\n", dj->size);
+		seq_printf(m, "dejitter_rate %u\n", dj->rate);
+		seq_printf(m, "dejitter_late %llu\n",
+				(unsigned long long)dj->stat_late);
+		seq_printf(m, "dejitter_overflow %llu\n",
+				(unsigned long long)dj->stat_overflow);
+		seq_printf(m, "dejitter_underruns %u\n", dj->stat_underruns);
+		seq_printf(m, "dejitter_jitter_avg_us %u\n",
+				dj->stat_jitter_avg_us);
+		seq_printf(m, "dejitter_jitter_max_us %u\n",
+				dj->stat_jitter_max_us);
+	} else {
+		seq_printf(m,
+			"  dejitter: fill %u/%u pkts (target %u), PCR PID %x, rate %u pkt/s\n"
+			"            late %llu, overflow %llu, underruns %u, PCR jitter avg/max %u/%u us\n",
+			dj_fill(dj), dj->size, dj->target,
+			dj->pcr_pid == PID_UNKNOWN ? 0x1fff : dj->pcr_pid, dj->rate,
+			(unsigned long long)dj->stat_late,
+			(unsigned long long)dj->stat_overflow, dj->stat_underruns,
+			dj->stat_jitter_avg_us, dj->stat_jitter_max_us);
+	}
+	spin_unlock_bh(&dj->lock);
+out:
+	up(&ctx->tswrite_sem);
+}
@@ -17,11 +17,11 @@
 
 #include <linux/module.h>	/* Specifically, a module */
 #include <linux/kernel.h>	/* We're doing kernel work */
-#include <linux/proc_fs.h>
 #include <linux/init.h>
 #include <linux/i2c.h>
 #include <asm/uaccess.h>
 #include <linux/delay.h>
+#include <linux/vmalloc.h>
 
 #include "demux.h"
 #include "dmxdev.h"
@@ -32,13 +32,13 @@
 
 #include "vtunerc_priv.h"
 
-#define VTUNERC_MODULE_VERSION "1.4"
+#define CREATE_TRACE_POINTS
+#include "vtunerc_trace.h"
 
 DVB_DEFINE_MOD_OPT_ADAPTER_NR(adapter_nr);
 
 #define DRIVER_NAME		"vTuner proxy"
 
-#define VTUNERC_PROC_FILENAME	"vtunerc%i"
 
 #ifndef VTUNERC_MAX_ADAPTERS
 #define VTUNERC_MAX_ADAPTERS	4
@@ -50,68 +50,19 @@ static struct vtunerc_ctx *vtunerc_tbl[VTUNERC_MAX_ADAPTERS] = { NULL };
 static struct vtunerc_config config = {
 	.devices = 1,
 	.tscheck = 0,
+	.pinthreshold = 256 * 1024,
+	.mboxspin = 0,
+	.psicache = 1,
+	.grace = 0,
 	.debug = 0
 };
 
-static int pidtab_find_index(unsigned short *pidtab, int pid)
-{
-	int i = 0;
-
-	while (i < MAX_PIDTAB_LEN) {
-		if (pidtab[i] == pid)
-			return i;
-		i++;
-	}
-
-	return -1;
-}
-
-static int pidtab_add_pid(unsigned short *pidtab, int pid)
-{
-	int i;
-
-	/* TODO: speed-up hint: add pid sorted */
-
-	for (i = 0; i < MAX_PIDTAB_LEN; i++)
-		if (pidtab[i] == PID_UNKNOWN) {
-			pidtab[i] = pid;
-			return 0;
-		}
-
-	return -1;
-}
-
-static int pidtab_del_pid(unsigned short *pidtab, int pid)
-{
-	int i;
-
-	/* TODO: speed-up hint: delete sorted */
-
-	for (i = 0; i < MAX_PIDTAB_LEN; i++)
-		if (pidtab[i] == pid) {
-			pidtab[i] = PID_UNKNOWN;
-			/* TODO: move rest */
-			return 0;
-		}
-
-	return -1;
-}
-
-static void pidtab_copy_to_msg(struct vtunerc_ctx *ctx,
-				struct vtuner_message *msg)
-{
-	int i;
-
-	for (i = 0; i < (MAX_PIDTAB_LEN - 1); i++)
-		msg->body.pidlist[i] = ctx->pidtab[i]; /*TODO: optimize it*/
-	msg->body.pidlist[MAX_PIDTAB_LEN - 1] = 0;
-}
-
 static int vtunerc_start_feed(struct dvb_demux_feed *feed)
 {
 	struct dvb_demux *demux = feed->demux;
 	struct vtunerc_ctx *ctx = demux->priv;
 	struct vtuner_message msg;
+	int ret;
 
 	switch (feed->type) {
 	case DMX_TYPE_TS:
@@ -130,14 +81,23 @@ static int vtunerc_start_feed(struct dvb_demux_feed *feed)
 
 	/* organize PID list table */
 
-	if (pidtab_find_index(ctx->pidtab, feed->pid) < 0) {
-		pidtab_add_pid(ctx->pidtab, feed->pid);
-
-		pidtab_copy_to_msg(ctx, &msg);
-
-		msg.type = MSG_PIDLIST;
+	ret = vtunerc_pidtab_get(ctx, feed->pid);
+	if (ret < 0) {
+		printk(KERN_ERR "vtunerc%d: PID table full\n", ctx->idx);
+		return ret;
+	}
+	if (ret) {
+		vtunerc_pidtab_to_msg(ctx, &msg);
 		vtunerc_ctrldev_xchange_message(ctx, &msg, 0);
 	}
+	vtunerc_secfilter_update(ctx, feed, 1);
+
+	trace_vtunerc_start_feed(ctx->idx, feed->pid, feed->type,
+				vtunerc_pidtab_users(ctx, feed->pid));
+	if (unlikely(ctx->capture))
+		vtunerc_capture_feed(ctx, 1, feed->pid, feed->type);
+
+	vtunerc_psi_start_feed(ctx, feed);
 
 	return 0;
 }
@@ -147,99 +107,33 @@ static int vtunerc_stop_feed(struct dvb_demux_feed *feed)
 	struct dvb_demux *demux = feed->demux;
 	struct vtunerc_ctx *ctx = demux->priv;
 	struct vtuner_message msg;
+	int ret;
 
-	/* organize PID list table */
+	vtunerc_psi_stop_feed(ctx, feed);
 
-	if (pidtab_find_index(ctx->pidtab, feed->pid) > -1) {
-		pidtab_del_pid(ctx->pidtab, feed->pid);
+	vtunerc_secfilter_update(ctx, feed, 0);
 
-		pidtab_copy_to_msg(ctx, &msg);
+	/* organize PID list table, the PID may be shared by more feeds */
 
-		msg.type = MSG_PIDLIST;
+	ret = vtunerc_pidtab_put(ctx, feed->pid);
+	if (ret < 0)
+		return 0;
+	if (ret) {
+		vtunerc_pidtab_to_msg(ctx, &msg);
 		vtunerc_ctrldev_xchange_message(ctx, &msg, 0);
 	}
 
+	trace_vtunerc_stop_feed(ctx->idx, feed->pid, feed->type,
+				vtunerc_pidtab_users(ctx, feed->pid));
+	if (unlikely(ctx->capture))
+		vtunerc_capture_feed(ctx, 0, feed->pid, feed->type);
+
 	return 0;
 }
 
 /* ----------------------------------------------------------- */
 
 
-#ifdef CONFIG_PROC_FS
-
-static char *get_fe_name(struct dvb_frontend_info *feinfo)
-{
-	return (feinfo && feinfo->name) ? feinfo->name : "(not set)";
-}
-
-/**
- * @brief  procfs file handler
- * @param  buffer:
- * @param  start:
- * @param  offset:
- * @param  size:
- * @param  eof:
- * @param  data:
- * @return =0: success <br/>
- *         <0: if any error occur
- */
-#define MAXBUF 512
-int vtunerc_read_proc(char *buffer, char **start, off_t offset, int size,
-			int *eof, void *data)
-{
-	char outbuf[MAXBUF] = "[ vtunerc driver, version "
-				VTUNERC_MODULE_VERSION " ]\n";
-	int blen, i, pcnt;
-	struct vtunerc_ctx *ctx = (struct vtunerc_ctx *)data;
-
-	blen = strlen(outbuf);
-	sprintf(outbuf+blen, "  sessions: %u\n", ctx->stat_ctrl_sess);
-	blen = strlen(outbuf);
-	sprintf(outbuf+blen, "  TS data : %u\n", ctx->stat_wr_data);
-	blen = strlen(outbuf);
-	sprintf(outbuf+blen, "  PID tab :");
-	pcnt = 0;
-	for (i = 0; i < MAX_PIDTAB_LEN; i++) {
-		blen = strlen(outbuf);
-		if (ctx->pidtab[i] != PID_UNKNOWN) {
-			sprintf(outbuf+blen, " %x", ctx->pidtab[i]);
-			pcnt++;
-		}
-	}
-	blen = strlen(outbuf);
-	sprintf(outbuf+blen, " (len=%d)\n", pcnt);
-	blen = strlen(outbuf);
-	sprintf(outbuf+blen, "  FE type : %s\n", get_fe_name(ctx->feinfo));
-
-	blen = strlen(outbuf);
-	sprintf(outbuf+blen, "  msg xchg: %d/%d\n", ctx->ctrldev_request.type, ctx->ctrldev_response.type);
-
-	blen = strlen(outbuf);
-
-	if (size < blen)
-		return -EINVAL;
-
-	if (offset != 0)
-		return 0;
-
-	strcpy(buffer, outbuf);
-
-	/* signal EOF */
-	*eof = 1;
-
-	return blen;
-
-}
-#endif
-
-static char *my_strdup(const char *s)
-{
-	char *rv = kmalloc(strlen(s)+1, GFP_KERNEL);
-	if (rv)
-		strcpy(rv, s);
-	return rv;
-}
-
 struct vtunerc_ctx *vtunerc_get_ctx(int minor)
 {
 	if (minor >= VTUNERC_MAX_ADAPTERS)
@@ -253,7 +147,7 @@ static int __init vtunerc_init(void)
 	struct vtunerc_ctx *ctx = NULL;
 	struct dvb_demux *dvbdemux;
 	struct dmx_demux *dmx;
-	int ret = -EINVAL, i, idx;
+	int ret = -EINVAL, idx;
 
 	printk(KERN_INFO "virtual DVB adapter driver, version "
 			VTUNERC_MODULE_VERSION
@@ -261,22 +155,45 @@ static int __init vtunerc_init(void)
 
 	request_module("dvb-core"); /* FIXME: dunno which way it should work :-/ */
 
+	vtunerc_stats_init();
+
 	for (idx = 0; idx < config.devices; idx++) {
 		ctx = kzalloc(sizeof(struct vtunerc_ctx), GFP_KERNEL);
 		if (!ctx) {
 			while(idx)
 				kfree(vtunerc_tbl[--idx]);
+			vtunerc_stats_exit();
 			return -ENOMEM;
 		}
 
 		vtunerc_tbl[idx] = ctx;
 
 		ctx->idx = idx;
+
+		ctx->pidstat = vzalloc(0x2001 * sizeof(struct vtunerc_pidstat));
+		ctx->ratepid = vmalloc(0x2001 * sizeof(u16));
+		if (!ctx->pidstat || !ctx->ratepid) {
+			ret = -ENOMEM;
+			goto err_kfree;
+		}
 		ctx->config = &config;
-		ctx->ctrldev_request.type = -1;
+		ctx->rate_stamp = jiffies;
+		ctx->pktsize = VTUNER_PKTFMT_188;
+		ret = vtunerc_psi_init(ctx);
+		if (ret)
+			goto err_kfree;
+		ret = vtunerc_resume_init(ctx);
+		if (ret)
+			goto err_kfree;
 		ctx->ctrldev_response.type = -1;
+		spin_lock_init(&ctx->ctrldev_lock);
 		init_waitqueue_head(&ctx->ctrldev_wait_request_wq);
+		init_waitqueue_head(&ctx->ctrldev_wait_space_wq);
 		init_waitqueue_head(&ctx->ctrldev_wait_response_wq);
+		init_waitqueue_head(&ctx->ctrldev_wait_write_wq);
+		init_waitqueue_head(&ctx->mbox_wq);
+		mutex_init(&ctx->ts_sock_mutex);
+		vtunerc_ctrldev_backlog_init(ctx);
 
 		// buffer
 		ctx->kernel_buf = NULL;
@@ -332,24 +249,18 @@ static int __init vtunerc_init(void)
 		sema_init(&ctx->tswrite_sem, 1);
 
 		/* init pid table */
-		for (i = 0; i < MAX_PIDTAB_LEN; i++)
-			ctx->pidtab[i] = PID_UNKNOWN;
-
-#ifdef CONFIG_PROC_FS
-		{
-			char procfilename[64];
-
-			sprintf(procfilename, VTUNERC_PROC_FILENAME,
-					ctx->idx);
-			ctx->procname = my_strdup(procfilename);
-			if (create_proc_read_entry(ctx->procname, 0, NULL,
-							vtunerc_read_proc,
-							ctx) == 0)
-				printk(KERN_WARNING
-					"vtunerc%d: Unable to register '%s' proc file\n",
-					ctx->idx, ctx->procname);
-		}
-#endif
+		vtunerc_pidtab_reset(ctx);
+
+		ret = dvb_net_init(&ctx->dvb_adapter, &ctx->dvbnet, dmx);
+		if (ret < 0)
+			goto err_disconnect_frontend;
+
+		ret = vtunerc_ca_init(ctx);
+		if (ret < 0)
+			goto err_dvb_net_release;
+
+		vtunerc_stats_register(ctx);
+		vtunerc_capture_init(ctx);
 	}
 
 	vtunerc_register_ctrldev(ctx);
@@ -357,6 +268,9 @@ static int __init vtunerc_init(void)
 out:
 	return ret;
 
+err_dvb_net_release:
+	dvb_net_release(&ctx->dvbnet);
+err_disconnect_frontend:
 	dmx->disconnect_frontend(dmx);
 err_remove_mem_frontend:
 	dmx->remove_frontend(dmx, &ctx->mem_frontend);
@@ -369,6 +283,10 @@ err_dvb_dmx_release:
 err_dvb_unregister_adapter:
 	dvb_unregister_adapter(&ctx->dvb_adapter);
 err_kfree:
+	vtunerc_resume_exit(ctx);
+	vtunerc_psi_exit(ctx);
+	vfree(ctx->ratepid);
+	vfree(ctx->pidstat);
 	kfree(ctx);
 	goto out;
 }
@@ -386,11 +304,16 @@ static void __exit vtunerc_exit(void)
 		if(!ctx)
 			continue;
 		vtunerc_tbl[idx] = NULL;
-#ifdef CONFIG_PROC_FS
-		remove_proc_entry(ctx->procname, NULL);
-		kfree(ctx->procname);
-#endif
-
+		vtunerc_ctrldev_backlog_exit(ctx);
+		vtunerc_capture_exit(ctx);
+		vtunerc_stats_unregister(ctx);
+		vtunerc_psi_exit(ctx);
+		vtunerc_resume_exit(ctx);
+
+		vtunerc_sock_stop(ctx);
+		vtunerc_dejitter_set(ctx, NULL);
+		vtunerc_ca_exit(ctx);
+		dvb_net_release(&ctx->dvbnet);
 		vtunerc_frontend_clear(ctx);
 
 		dvbdemux = &ctx->demux;
@@ -412,9 +335,17 @@ static void __exit vtunerc_exit(void)
 
 		}
 
+		if (ctx->mbox_efd)
+			eventfd_ctx_put(ctx->mbox_efd);
+		vfree(ctx->mbox);
+		vfree(ctx->ratepid);
+		vfree(ctx->pidstat);
+
 		kfree(ctx);
 	}
 
+	vtunerc_stats_exit();
+
 	printk(KERN_NOTICE "vtunerc: unloaded successfully\n");
 }
 
@@ -432,6 +363,19 @@ MODULE_PARM_DESC(devices, "Number of virtual adapters (default is 1)");
 module_param_named(tscheck, config.tscheck, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
 MODULE_PARM_DESC(tscheck, "Check TS packet validity (default is 0)");
 
+module_param_named(pinthreshold, config.pinthreshold, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(pinthreshold, "Writes of this size or larger are demuxed from pinned user pages a chunk at a time, 0 disables (default is 262144)");
+
+module_param_named(mboxspin, config.mboxspin, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(mboxspin, "Busy-poll the control mailbox for this many us before sleeping (default is 0)");
+
+/* the cache is allocated at load time, so no runtime changes */
+module_param_named(psicache, config.psicache, int, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(psicache, "Cache PAT/PMT/NIT/SDT sections for new section filters, set at load time (default is 1)");
+
+module_param_named(grace, config.grace, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(grace, "Keep reporting the last frontend status for this many ms after the daemon went away (default is 0)");
+
 module_param_named(debug, config.debug, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
 MODULE_PARM_DESC(debug, "Enable debug messages (default is 0)");
 
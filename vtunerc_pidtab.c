@@ -0,0 +1,127 @@
+/*
+ * vtunerc: table of PIDs requested from the daemon
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Used PIDs are kept packed at the start of pidtab[], pidtab_len of
+ * them, with a user count each (a PID may be shared by more feeds).
+ * The rest of the table is PID_UNKNOWN. pidmap mirrors the table for
+ * the per-packet lookup on the write path.
+ * Callers serialize, start/stop_feed run under the demux mutex.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/string.h>
+
+#include "vtunerc_priv.h"
+
+void vtunerc_pidtab_reset(struct vtunerc_ctx *ctx)
+{
+	int i;
+
+	for (i = 0; i < MAX_PIDTAB_LEN; i++) {
+		ctx->pidtab[i] = PID_UNKNOWN;
+		ctx->pidtab_users[i] = 0;
+	}
+	ctx->pidtab_len = 0;
+	bitmap_zero(ctx->pidmap, 0x2001);
+}
+VTUNERC_EXPORT_FOR_TEST(vtunerc_pidtab_reset);
+
+int vtunerc_pidtab_find(struct vtunerc_ctx *ctx, u16 pid)
+{
+	int i;
+
+	for (i = 0; i < ctx->pidtab_len; i++)
+		if (ctx->pidtab[i] == pid)
+			return i;
+
+	return -1;
+}
+
+/*
+ * take a reference on the PID, returns 1 when it was added
+ * (the list for the daemon changed), 0 when it was there already
+ */
+int vtunerc_pidtab_get(struct vtunerc_ctx *ctx, u16 pid)
+{
+	int idx = vtunerc_pidtab_find(ctx, pid);
+
+	if (idx >= 0) {
+		ctx->pidtab_users[idx]++;
+		return 0;
+	}
+
+	if (ctx->pidtab_len == MAX_PIDTAB_LEN)
+		return -EBUSY;
+
+	idx = ctx->pidtab_len++;
+	ctx->pidtab[idx] = pid;
+	ctx->pidtab_users[idx] = 1;
+	if (pid <= 0x2000)
+		set_bit(pid, ctx->pidmap);
+
+	return 1;
+}
+VTUNERC_EXPORT_FOR_TEST(vtunerc_pidtab_get);
+
+/* drop a reference, returns 1 when the last one went */
+int vtunerc_pidtab_put(struct vtunerc_ctx *ctx, u16 pid)
+{
+	int idx = vtunerc_pidtab_find(ctx, pid);
+	int last;
+
+	if (idx < 0)
+		return -ENOENT;
+
+	if (--ctx->pidtab_users[idx])
+		return 0;
+
+	/* fill the hole with the last entry */
+	last = --ctx->pidtab_len;
+	ctx->pidtab[idx] = ctx->pidtab[last];
+	ctx->pidtab_users[idx] = ctx->pidtab_users[last];
+	ctx->pidtab[last] = PID_UNKNOWN;
+	ctx->pidtab_users[last] = 0;
+	if (pid <= 0x2000)
+		clear_bit(pid, ctx->pidmap);
+
+	return 1;
+}
+VTUNERC_EXPORT_FOR_TEST(vtunerc_pidtab_put);
+
+int vtunerc_pidtab_users(struct vtunerc_ctx *ctx, u16 pid)
+{
+	int idx = vtunerc_pidtab_find(ctx, pid);
+
+	return idx < 0 ? 0 : ctx->pidtab_users[idx];
+}
+VTUNERC_EXPORT_FOR_TEST(vtunerc_pidtab_users);
+
+void vtunerc_pidtab_to_msg(struct vtunerc_ctx *ctx, struct vtuner_message *msg)
+{
+	msg->type = MSG_PIDLIST;
+
+	/* the full TS takes everything, say so in one entry */
+	if (test_bit(0x2000, ctx->pidmap)) {
+		memset(msg->body.pidlist, 0xff, sizeof(msg->body.pidlist));
+		msg->body.pidlist[0] = 0x2000;
+		msg->body.pidlist[MAX_PIDTAB_LEN - 1] = 0;
+		return;
+	}
+
+	memcpy(msg->body.pidlist, ctx->pidtab,
+			(MAX_PIDTAB_LEN - 1) * sizeof(msg->body.pidlist[0]));
+	msg->body.pidlist[MAX_PIDTAB_LEN - 1] = 0;
+}
+VTUNERC_EXPORT_FOR_TEST(vtunerc_pidtab_to_msg);
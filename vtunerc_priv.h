@@ -19,7 +19,14 @@
 
 #include <linux/module.h>	/* Specifically, a module */
 #include <linux/kernel.h>	/* We're doing kernel work */
+#include <linux/version.h>
 #include <linux/cdev.h>
+#include <linux/bitops.h>
+#include <linux/eventfd.h>
+#include <linux/mutex.h>
+#include <linux/net.h>
+#include <linux/workqueue.h>
+#include <linux/u64_stats_sync.h>
 
 #include "demux.h"
 #include "dmxdev.h"
@@ -29,6 +36,8 @@
 #include "dvbdev.h"
 
 #include "vtuner.h"
+#include "vtunerc_proto.h"
+#include "vtunerc_ts.h"
 
 #define MAX_PIDTAB_LEN 30
 
@@ -36,11 +45,43 @@
 
 #define MAX_NUM_VTUNER_MODES 3
 
+#define VTUNERC_MODULE_VERSION "1.4"
+
+#define VTUNERC_CTRLDEV_QLEN 16	/* queued requests for the daemon */
+
 struct vtunerc_config {
 
 	int debug;
 	int tscheck;
 	int devices;
+	int pinthreshold;
+	int mboxspin;
+	int psicache;
+	int grace;
+};
+
+/* queued request for the daemon */
+struct vtunerc_req {
+	u32 seq;
+	u16 flags;
+	struct vtuner_message msg;
+};
+
+struct vtunerc_dejitter;
+struct vtunerc_psi;
+struct vtunerc_resume;
+struct vtunerc_ca;
+struct seq_file;
+struct rchan;
+
+#define VTUNERC_STAT_MSGTYPES	32	/* the last one counts all others */
+
+/* control channel counters, updated under ctrldev_lock */
+struct vtunerc_ctrl_stats {
+	u64 rd_bytes;
+	u64 requests;
+	u64 responses;
+	u64 msgs[VTUNERC_STAT_MSGTYPES];
 };
 
 struct vtunerc_ctx {
@@ -65,10 +106,23 @@ struct vtunerc_ctx {
 	struct vtunerc_config *config;
 
 	unsigned short pidtab[MAX_PIDTAB_LEN];
+	unsigned char pidtab_users[MAX_PIDTAB_LEN];
+	int pidtab_len;
+	DECLARE_BITMAP(pidmap, 0x2001);	/* active feeds, 0x2000 = full TS */
+	DECLARE_BITMAP(secmap, 0x2000);	/* PIDs with filters at the daemon */
 
 	struct semaphore xchange_sem;
 	struct semaphore ioctl_sem;
 	struct semaphore tswrite_sem;
+	int tswrite_busy;
+	int dejitter_backlog;	/* dejitter buffer more than 3/4 full */
+	struct delayed_work backlog_work;
+	int tsbulk;		/* last batch went to full TS feeds in bulk */
+	unsigned int pktsize;	/* written packets, VTUNER_PKTFMT_* */
+	u32 stamp;		/* last 192 byte packet time stamp */
+	u64 stamp_ns;		/* and when it came */
+	int stamp_valid;
+	s64 stamp_jitter;	/* ns, see vtunerc_ctrldev_stamp() */
 	int fd_opened;
 	int closing;
 
@@ -77,22 +131,65 @@ struct vtunerc_ctx {
 	char *kernel_buf;
 	ssize_t kernel_buf_size;
 
+	struct vtunerc_dejitter *dejitter;
+
+	struct vtunerc_psi *psi;
+	DECLARE_BITMAP(psimap, 0x2000);	/* PIDs parsed for the PSI cache */
+
+	struct vtunerc_resume *resume;	/* state replayed to a new daemon */
+
+	struct vtunerc_ca *ca_priv;	/* behind ca, see vtunerc_ca.c */
+
+	struct rchan *capture;		/* see vtunerc_capture.c for locking */
+	unsigned int capture_kb;
+	u32 capture_seq;
+
 	/* ctrldev */
-	char trail[188];
+	u8 trail[188];
 	unsigned int trailsize;
-	int noresponse;
 	int num_modes;
+	u32 proto_version;
+	u32 proto_caps;
 	char *ctypes[MAX_NUM_VTUNER_MODES];
-	struct vtuner_message ctrldev_request;
+	spinlock_t ctrldev_lock;
+	struct vtunerc_req ctrldev_reqq[VTUNERC_CTRLDEV_QLEN];
+	unsigned int ctrldev_reqq_head;
+	unsigned int ctrldev_reqq_tail;
+	u32 ctrldev_seq;
+	u32 ctrldev_wait_seq;
+	unsigned int ctrldev_orphans;	/* picked up, waiter gone */
 	struct vtuner_message ctrldev_response;
 	wait_queue_head_t ctrldev_wait_request_wq;
+	wait_queue_head_t ctrldev_wait_space_wq;
 	wait_queue_head_t ctrldev_wait_response_wq;
+	wait_queue_head_t ctrldev_wait_write_wq;
+
+	/* in-kernel TS socket */
+	struct mutex ts_sock_mutex;
+	struct socket *ts_sock;
+	struct task_struct *ts_thread;
+
+	/* shared-memory mailbox */
+	struct vtuner_mbox *mbox;
+	int mbox_on;
+	struct eventfd_ctx *mbox_efd;
+	unsigned int mbox_req_head;
+	unsigned int mbox_rsp_tail;
+	int mbox_waiters;
+	wait_queue_head_t mbox_wq;
 
-	/* proc statistics */
-	unsigned int stat_wr_data;
-	unsigned int stat_rd_data;
+	/* statistics */
+	struct dentry *dbgfs;
 	unsigned int stat_ctrl_sess;
-	unsigned short pidstat[MAX_PIDTAB_LEN];
+	struct u64_stats_sync ts_syncp;
+	struct vtunerc_ts_stats ts_stats;
+	struct u64_stats_sync ctrl_syncp;
+	struct vtunerc_ctrl_stats ctrl_stats;
+	struct vtunerc_pidstat *pidstat;	/* 0x2001, 0x2000 = full TS in bulk */
+	u16 *ratepid;			/* PIDs with packets or a rate left */
+	unsigned int nratepids;
+	unsigned long rate_stamp;
+	u64 rate;			/* sum of PID rates, bit/s */
 };
 
 int vtunerc_register_ctrldev(struct vtunerc_ctx *ctx);
@@ -100,9 +197,102 @@ void vtunerc_unregister_ctrldev(struct vtunerc_config *config);
 struct vtunerc_ctx *vtunerc_get_ctx(int minor);
 int /*__devinit*/ vtunerc_frontend_init(struct vtunerc_ctx *ctx, int vtype);
 int /*__devinit*/ vtunerc_frontend_clear(struct vtunerc_ctx *ctx);
+int vtunerc_proxyfe_encode(struct vtunerc_ctx *ctx,
+				const struct dtv_frontend_properties *c,
+				struct vtuner_message *msg);
 int vtunerc_ctrldev_xchange_message(struct vtunerc_ctx *ctx,
 					struct vtuner_message *msg,
 					int wait4response);
+int vtunerc_ctrldev_xchange_timeout(struct vtunerc_ctx *ctx,
+					struct vtuner_message *msg,
+					int wait4response, long timeout);
+int vtunerc_ctrldev_ingest(struct vtunerc_ctx *ctx, const u8 *buf, size_t len,
+			int cut);
+void vtunerc_ctrldev_rates_refresh(struct vtunerc_ctx *ctx);
+void vtunerc_ctrldev_backlog_init(struct vtunerc_ctx *ctx);
+void vtunerc_ctrldev_backlog_exit(struct vtunerc_ctx *ctx);
+void vtunerc_dejitter_put(struct vtunerc_ctx *ctx, const u8 *buf, size_t len);
+int vtunerc_dejitter_set(struct vtunerc_ctx *ctx, struct vtuner_dejitter *cfg);
+void vtunerc_dejitter_show(struct vtunerc_ctx *ctx, struct seq_file *m,
+				int raw);
+int vtunerc_sock_start(struct vtunerc_ctx *ctx, int fd);
+void vtunerc_sock_stop(struct vtunerc_ctx *ctx);
+void vtunerc_pidtab_reset(struct vtunerc_ctx *ctx);
+int vtunerc_pidtab_find(struct vtunerc_ctx *ctx, u16 pid);
+int vtunerc_pidtab_get(struct vtunerc_ctx *ctx, u16 pid);
+int vtunerc_pidtab_put(struct vtunerc_ctx *ctx, u16 pid);
+int vtunerc_pidtab_users(struct vtunerc_ctx *ctx, u16 pid);
+void vtunerc_pidtab_to_msg(struct vtunerc_ctx *ctx, struct vtuner_message *msg);
+void vtunerc_secfilter_update(struct vtunerc_ctx *ctx,
+				struct dvb_demux_feed *feed, int start);
+int vtunerc_secfilter_resend(struct vtunerc_ctx *ctx, long timeout);
+void vtunerc_stats_ts(struct vtunerc_ctx *ctx,
+			const struct vtunerc_ts_stats *st);
+void vtunerc_stats_msg(struct vtunerc_ctx *ctx, int type, int response);
+void vtunerc_stats_read(struct vtunerc_ctx *ctx, size_t len);
+int vtunerc_stats_register(struct vtunerc_ctx *ctx);
+void vtunerc_stats_unregister(struct vtunerc_ctx *ctx);
+void vtunerc_stats_init(void);
+void vtunerc_capture_ts(struct vtunerc_ctx *ctx, const u8 *buf, size_t len);
+u32 vtunerc_capture_msg(struct vtunerc_ctx *ctx, u32 type, u32 seq,
+			const struct vtuner_message *msg);
+void vtunerc_capture_feed(struct vtunerc_ctx *ctx, int start, u16 pid,
+				int feed_type);
+void vtunerc_capture_init(struct vtunerc_ctx *ctx);
+void vtunerc_capture_exit(struct vtunerc_ctx *ctx);
+void vtunerc_stats_exit(void);
+void vtunerc_psi_ts(struct vtunerc_ctx *ctx, const u8 *p);
+void vtunerc_psi_start_feed(struct vtunerc_ctx *ctx,
+				struct dvb_demux_feed *feed);
+void vtunerc_psi_stop_feed(struct vtunerc_ctx *ctx,
+				struct dvb_demux_feed *feed);
+void vtunerc_psi_reset(struct vtunerc_ctx *ctx);
+int vtunerc_psi_init(struct vtunerc_ctx *ctx);
+void vtunerc_psi_exit(struct vtunerc_ctx *ctx);
+void vtunerc_resume_note(struct vtunerc_ctx *ctx,
+				const struct vtuner_message *msg);
+void vtunerc_resume_answer(struct vtunerc_ctx *ctx, int type,
+				const struct vtuner_message *msg);
+int vtunerc_resume_hold(struct vtunerc_ctx *ctx, struct vtuner_message *msg);
+void vtunerc_resume_connect(struct vtunerc_ctx *ctx);
+void vtunerc_resume_start(struct vtunerc_ctx *ctx);
+void vtunerc_resume_disconnect(struct vtunerc_ctx *ctx);
+int vtunerc_resume_init(struct vtunerc_ctx *ctx);
+void vtunerc_resume_exit(struct vtunerc_ctx *ctx);
+long vtunerc_ca_ctrldev_ioctl(struct vtunerc_ctx *ctx, struct file *filp,
+				unsigned int cmd, unsigned long arg);
+int vtunerc_ca_pending(struct vtunerc_ctx *ctx);
+void vtunerc_ca_disconnect(struct vtunerc_ctx *ctx);
+int vtunerc_ca_init(struct vtunerc_ctx *ctx);
+void vtunerc_ca_exit(struct vtunerc_ctx *ctx);
+/* demux callbacks lost their status in 4.4 and got buffer flags in 4.16 */
+static inline int vtunerc_dmx_ts_cb(struct dvb_demux_feed *feed,
+					const u8 *buf, size_t len)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+	return feed->cb.ts(buf, len, NULL, 0, &feed->feed.ts,
+				&feed->buffer_flags);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
+	return feed->cb.ts(buf, len, NULL, 0, &feed->feed.ts);
+#else
+	return feed->cb.ts(buf, len, NULL, 0, &feed->feed.ts, DMX_OK);
+#endif
+}
+
+static inline int vtunerc_dmx_sec_cb(struct dvb_demux_feed *feed,
+					struct dvb_demux_filter *f,
+					const u8 *buf, size_t len)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+	return feed->cb.sec(buf, len, NULL, 0, &f->filter,
+				&feed->buffer_flags);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
+	return feed->cb.sec(buf, len, NULL, 0, &f->filter);
+#else
+	return feed->cb.sec(buf, len, NULL, 0, &f->filter, DMX_OK);
+#endif
+}
+
 #define dprintk(ctx, fmt, arg...) do {					\
 if (ctx->config && (ctx->config->debug))				\
 	printk(KERN_DEBUG "vtunerc%d: " fmt, ctx->idx, ##arg);	\
@@ -0,0 +1,117 @@
+/*
+ * vtunerc: vtuner message encoding
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/errno.h>
+
+#include "vtunerc_proto.h"
+
+#define BODY_SIZE		sizeof(((struct vtuner_message *)0)->body)
+#define BODY_LEN(member)	sizeof(((struct vtuner_message *)0)->body.member)
+#define MSG_ALIGN(len)		(((len) + VTUNER_MSG_ALIGN - 1) & ~(VTUNER_MSG_ALIGN - 1))
+
+/* number of body bytes really used by the message type */
+size_t vtunerc_proto_body_len(s32 type)
+{
+	switch (type) {
+	case MSG_SET_FRONTEND:
+	case MSG_GET_FRONTEND:
+		return BODY_LEN(fe_params);
+	case MSG_READ_STATUS:
+		return BODY_LEN(status);
+	case MSG_READ_BER:
+		return BODY_LEN(ber);
+	case MSG_READ_SIGNAL_STRENGTH:
+		return BODY_LEN(ss);
+	case MSG_READ_SNR:
+		return BODY_LEN(snr);
+	case MSG_READ_UCBLOCKS:
+		return BODY_LEN(ucb);
+	case MSG_SET_TONE:
+		return BODY_LEN(tone);
+	case MSG_SET_VOLTAGE:
+		return BODY_LEN(voltage);
+	case MSG_SEND_DISEQC_MSG:
+		return BODY_LEN(diseqc_master_cmd);
+	case MSG_SEND_DISEQC_BURST:
+		return BODY_LEN(burst);
+	case MSG_PIDLIST:
+		return BODY_LEN(pidlist);
+	case MSG_TYPE_CHANGED:
+		return BODY_LEN(type_changed);
+	case MSG_SET_PROPERTY:
+	case MSG_GET_PROPERTY:
+		return BODY_LEN(prop);
+	case MSG_DISCOVER:
+		return BODY_LEN(discover);
+	case MSG_SECFILTER:
+		return BODY_LEN(secfilter);
+	case 0:
+	case MSG_NULL:
+		return 0;
+	default:
+		return BODY_SIZE;
+	}
+}
+
+/* write framed message into buf, returns record length */
+int vtunerc_proto_encode(const struct vtuner_message *msg, u32 seq, u16 flags,
+				void *buf, size_t size)
+{
+	struct vtuner_msg_hdr *hdr = buf;
+	size_t len = vtunerc_proto_body_len(msg->type);
+	size_t reclen = sizeof(*hdr) + MSG_ALIGN(len);
+
+	if (size < reclen)
+		return -EMSGSIZE;
+
+	hdr->version = VTUNER_PROTO_VERSION;
+	hdr->reserved = 0;
+	hdr->flags = flags;
+	hdr->len = len;
+	hdr->reserved2 = 0;
+	hdr->seq = seq;
+	hdr->type = msg->type;
+	memcpy(hdr + 1, &msg->body, len);
+	memset((u8 *)(hdr + 1) + len, 0, reclen - sizeof(*hdr) - len);
+
+	return reclen;
+}
+
+/* parse framed message from buf, returns record length */
+int vtunerc_proto_decode(const void *buf, size_t size,
+				struct vtuner_message *msg, u32 *seq, u16 *flags)
+{
+	const struct vtuner_msg_hdr *hdr = buf;
+	size_t reclen;
+
+	if (size < sizeof(*hdr))
+		return -EINVAL;
+
+	if (hdr->version != VTUNER_PROTO_VERSION ||
+			hdr->len > sizeof(msg->body))
+		return -EINVAL;
+
+	reclen = sizeof(*hdr) + MSG_ALIGN(hdr->len);
+	if (size < sizeof(*hdr) + hdr->len)
+		return -EINVAL;
+
+	memset(msg, 0, sizeof(*msg));
+	msg->type = hdr->type;
+	memcpy(&msg->body, hdr + 1, hdr->len);
+	*seq = hdr->seq;
+	*flags = hdr->flags;
+
+	return reclen > size ? size : reclen;
+}
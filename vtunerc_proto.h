@@ -0,0 +1,28 @@
+/*
+ * vtunerc: vtuner message encoding
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _VTUNERC_PROTO_H
+#define _VTUNERC_PROTO_H
+
+#include "vtuner.h"
+
+/* capabilities supported by this driver */
+#define VTUNERC_CAPS	(VTUNER_CAP_FRAMED | VTUNER_CAP_SECFILTER)
+
+size_t vtunerc_proto_body_len(s32 type);
+int vtunerc_proto_encode(const struct vtuner_message *msg, u32 seq, u16 flags,
+				void *buf, size_t size);
+int vtunerc_proto_decode(const void *buf, size_t size,
+				struct vtuner_message *msg, u32 *seq, u16 *flags);
+
+#endif
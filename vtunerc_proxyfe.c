@@ -22,6 +22,7 @@
 #include "dvb_frontend.h"
 
 #include "vtunerc_priv.h"
+#include "vtunerc_trace.h"
 
 #if (DVB_API_VERSION << 8 | DVB_API_VERSION_MINOR) < 0x0505
 #error ========================================================================
@@ -35,6 +36,25 @@ struct dvb_proxyfe_state {
 	struct vtunerc_ctx *ctx;
 };
 
+/* frontend requests waiting for response, traced for latency */
+static void dvb_proxyfe_xchange(struct vtunerc_ctx *ctx,
+				struct vtuner_message *msg)
+{
+	int type = msg->type;
+	int ret;
+
+	if (vtunerc_resume_hold(ctx, msg))
+		return;
+	vtunerc_resume_note(ctx, msg);
+
+	trace_vtunerc_fe_op_start(ctx->idx, type);
+	ret = vtunerc_ctrldev_xchange_message(ctx, msg, 1);
+	trace_vtunerc_fe_op_end(ctx->idx, type, ret);
+
+	if (!ret)
+		vtunerc_resume_answer(ctx, type, msg);
+}
+
 
 static int dvb_proxyfe_read_status(struct dvb_frontend *fe, fe_status_t *status)
 {
@@ -43,7 +63,7 @@ static int dvb_proxyfe_read_status(struct dvb_frontend *fe, fe_status_t *status)
 	struct vtuner_message msg;
 
 	msg.type = MSG_READ_STATUS;
-	vtunerc_ctrldev_xchange_message(ctx, &msg, 1);
+	dvb_proxyfe_xchange(ctx, &msg);
 
 	*status = msg.body.status;
 
@@ -57,7 +77,7 @@ static int dvb_proxyfe_read_ber(struct dvb_frontend *fe, u32 *ber)
 	struct vtuner_message msg;
 
 	msg.type = MSG_READ_BER;
-	vtunerc_ctrldev_xchange_message(ctx, &msg, 1);
+	dvb_proxyfe_xchange(ctx, &msg);
 
 	*ber = msg.body.ber;
 
@@ -72,7 +92,7 @@ static int dvb_proxyfe_read_signal_strength(struct dvb_frontend *fe,
 	struct vtuner_message msg;
 
 	msg.type = MSG_READ_SIGNAL_STRENGTH;
-	vtunerc_ctrldev_xchange_message(ctx, &msg, 1);
+	dvb_proxyfe_xchange(ctx, &msg);
 
 	*strength = msg.body.ss;
 
@@ -86,7 +106,7 @@ static int dvb_proxyfe_read_snr(struct dvb_frontend *fe, u16 *snr)
 	struct vtuner_message msg;
 
 	msg.type = MSG_READ_SNR;
-	vtunerc_ctrldev_xchange_message(ctx, &msg, 1);
+	dvb_proxyfe_xchange(ctx, &msg);
 
 	*snr = msg.body.snr;
 
@@ -100,7 +120,7 @@ static int dvb_proxyfe_read_ucblocks(struct dvb_frontend *fe, u32 *ucblocks)
 	struct vtuner_message msg;
 
 	msg.type = MSG_READ_UCBLOCKS;
-	vtunerc_ctrldev_xchange_message(ctx, &msg, 1);
+	dvb_proxyfe_xchange(ctx, &msg);
 
 	*ucblocks = msg.body.ucb;
 
@@ -115,7 +135,7 @@ static int dvb_proxyfe_get_frontend(struct dvb_frontend *fe)
 	struct vtuner_message msg;
 
 	msg.type = MSG_GET_FRONTEND;
-	vtunerc_ctrldev_xchange_message(ctx, &msg, 1);
+	dvb_proxyfe_xchange(ctx, &msg);
 
 	switch (ctx->vtype) {
 	case VT_S:
@@ -155,66 +175,65 @@ static int dvb_proxyfe_get_frontend(struct dvb_frontend *fe)
 	return 0;
 }
 
-static int dvb_proxyfe_set_frontend(struct dvb_frontend *fe)
+/* MSG_SET_FRONTEND for the tuning parameters in c */
+int vtunerc_proxyfe_encode(struct vtunerc_ctx *ctx,
+				const struct dtv_frontend_properties *c,
+				struct vtuner_message *msg)
 {
-	struct dtv_frontend_properties *c = &fe->dtv_property_cache;
-	struct dvb_proxyfe_state *state = fe->demodulator_priv;
-	struct vtunerc_ctx *ctx = state->ctx;
-	struct vtuner_message msg;
-
-	memset(&msg, 0, sizeof(msg));
-	msg.body.fe_params.frequency = c->frequency;
-	msg.body.fe_params.inversion = c->inversion;
+	memset(msg, 0, sizeof(*msg));
+	msg->type = MSG_SET_FRONTEND;
+	msg->body.fe_params.frequency = c->frequency;
+	msg->body.fe_params.inversion = c->inversion;
 
 	switch (ctx->vtype) {
 	case VT_S:
 	case VT_S2:
-		msg.body.fe_params.u.qpsk.symbol_rate = c->symbol_rate;
-		msg.body.fe_params.u.qpsk.fec_inner = c->fec_inner;
+		msg->body.fe_params.u.qpsk.symbol_rate = c->symbol_rate;
+		msg->body.fe_params.u.qpsk.fec_inner = c->fec_inner;
 
 		if (ctx->vtype == VT_S2 && c->delivery_system == SYS_DVBS2) {
 			/* DELIVERY SYSTEM: S2 delsys in use */
-			msg.body.fe_params.u.qpsk.fec_inner = 9;
+			msg->body.fe_params.u.qpsk.fec_inner = 9;
 
 			/* MODULATION */
 			if (c->modulation == PSK_8)
 				/* signal PSK_8 modulation used */
-				msg.body.fe_params.u.qpsk.fec_inner += 9;
+				msg->body.fe_params.u.qpsk.fec_inner += 9;
 
 			/* FEC */
 			switch (c->fec_inner) {
 			case FEC_1_2:
-				msg.body.fe_params.u.qpsk.fec_inner += 1;
+				msg->body.fe_params.u.qpsk.fec_inner += 1;
 				break;
 			case FEC_2_3:
-				msg.body.fe_params.u.qpsk.fec_inner += 2;
+				msg->body.fe_params.u.qpsk.fec_inner += 2;
 				break;
 			case FEC_3_4:
-				msg.body.fe_params.u.qpsk.fec_inner += 3;
+				msg->body.fe_params.u.qpsk.fec_inner += 3;
 				break;
 			case FEC_4_5:
-				msg.body.fe_params.u.qpsk.fec_inner += 8;
+				msg->body.fe_params.u.qpsk.fec_inner += 8;
 				break;
 			case FEC_5_6:
-				msg.body.fe_params.u.qpsk.fec_inner += 4;
+				msg->body.fe_params.u.qpsk.fec_inner += 4;
 				break;
 			/*case FEC_6_7: // undefined
-				msg.body.fe_params.u.qpsk.fec_inner += 2;
+				msg->body.fe_params.u.qpsk.fec_inner += 2;
 				break;*/
 			case FEC_7_8:
-				msg.body.fe_params.u.qpsk.fec_inner += 5;
+				msg->body.fe_params.u.qpsk.fec_inner += 5;
 				break;
 			case FEC_8_9:
-				msg.body.fe_params.u.qpsk.fec_inner += 6;
+				msg->body.fe_params.u.qpsk.fec_inner += 6;
 				break;
 			/*case FEC_AUTO: // undefined
-				msg.body.fe_params.u.qpsk.fec_inner += 2;
+				msg->body.fe_params.u.qpsk.fec_inner += 2;
 				break;*/
 			case FEC_3_5:
-				msg.body.fe_params.u.qpsk.fec_inner += 7;
+				msg->body.fe_params.u.qpsk.fec_inner += 7;
 				break;
 			case FEC_9_10:
-				msg.body.fe_params.u.qpsk.fec_inner += 9;
+				msg->body.fe_params.u.qpsk.fec_inner += 9;
 				break;
 			default:
 				; /*FIXME: what now? */
@@ -224,10 +243,10 @@ static int dvb_proxyfe_set_frontend(struct dvb_frontend *fe)
 			/* ROLLOFF */
 			switch (c->rolloff) {
 			case ROLLOFF_20:
-				msg.body.fe_params.inversion |= 0x08;
+				msg->body.fe_params.inversion |= 0x08;
 				break;
 			case ROLLOFF_25:
-				msg.body.fe_params.inversion |= 0x04;
+				msg->body.fe_params.inversion |= 0x04;
 				break;
 			case ROLLOFF_35:
 			default:
@@ -237,10 +256,10 @@ static int dvb_proxyfe_set_frontend(struct dvb_frontend *fe)
 			/* PILOT */
 			switch (c->pilot) {
 			case PILOT_ON:
-				msg.body.fe_params.inversion |= 0x10;
+				msg->body.fe_params.inversion |= 0x10;
 				break;
 			case PILOT_AUTO:
-				msg.body.fe_params.inversion |= 0x20;
+				msg->body.fe_params.inversion |= 0x20;
 				break;
 			case PILOT_OFF:
 			default:
@@ -249,18 +268,18 @@ static int dvb_proxyfe_set_frontend(struct dvb_frontend *fe)
 		}
 		break;
 	case VT_T:
-		msg.body.fe_params.u.ofdm.bandwidth = c->bandwidth_hz;
-		msg.body.fe_params.u.ofdm.code_rate_HP = c->code_rate_HP;
-		msg.body.fe_params.u.ofdm.code_rate_LP = c->code_rate_LP;
-		msg.body.fe_params.u.ofdm.constellation = c->modulation;
-		msg.body.fe_params.u.ofdm.transmission_mode = c->transmission_mode;
-		msg.body.fe_params.u.ofdm.guard_interval = c->guard_interval;
-		msg.body.fe_params.u.ofdm.hierarchy_information = c->hierarchy;
+		msg->body.fe_params.u.ofdm.bandwidth = c->bandwidth_hz;
+		msg->body.fe_params.u.ofdm.code_rate_HP = c->code_rate_HP;
+		msg->body.fe_params.u.ofdm.code_rate_LP = c->code_rate_LP;
+		msg->body.fe_params.u.ofdm.constellation = c->modulation;
+		msg->body.fe_params.u.ofdm.transmission_mode = c->transmission_mode;
+		msg->body.fe_params.u.ofdm.guard_interval = c->guard_interval;
+		msg->body.fe_params.u.ofdm.hierarchy_information = c->hierarchy;
 		break;
 	case VT_C:
-		msg.body.fe_params.u.qam.symbol_rate = c->symbol_rate;
-		msg.body.fe_params.u.qam.fec_inner = c->fec_inner;
-		msg.body.fe_params.u.qam.modulation = c->modulation;
+		msg->body.fe_params.u.qam.symbol_rate = c->symbol_rate;
+		msg->body.fe_params.u.qam.fec_inner = c->fec_inner;
+		msg->body.fe_params.u.qam.modulation = c->modulation;
 		break;
 	default:
 		printk(KERN_ERR "vtunerc%d: unregognized tuner vtype = %d\n",
@@ -268,8 +287,25 @@ static int dvb_proxyfe_set_frontend(struct dvb_frontend *fe)
 		return -EINVAL;
 	}
 
-	msg.type = MSG_SET_FRONTEND;
-	vtunerc_ctrldev_xchange_message(ctx, &msg, 1);
+	return 0;
+}
+VTUNERC_EXPORT_FOR_TEST(vtunerc_proxyfe_encode);
+
+static int dvb_proxyfe_set_frontend(struct dvb_frontend *fe)
+{
+	struct dtv_frontend_properties *c = &fe->dtv_property_cache;
+	struct dvb_proxyfe_state *state = fe->demodulator_priv;
+	struct vtunerc_ctx *ctx = state->ctx;
+	struct vtuner_message msg;
+	int ret;
+
+	ret = vtunerc_proxyfe_encode(ctx, c, &msg);
+	if (ret)
+		return ret;
+
+	vtunerc_psi_reset(ctx);
+
+	dvb_proxyfe_xchange(ctx, &msg);
 
 	return 0;
 }
@@ -302,7 +338,7 @@ static int dvb_proxyfe_set_tone(struct dvb_frontend *fe, fe_sec_tone_mode_t tone
 
 	msg.body.tone = tone;
 	msg.type = MSG_SET_TONE;
-	vtunerc_ctrldev_xchange_message(ctx, &msg, 1);
+	dvb_proxyfe_xchange(ctx, &msg);
 
 	return 0;
 }
@@ -315,7 +351,7 @@ static int dvb_proxyfe_set_voltage(struct dvb_frontend *fe, fe_sec_voltage_t vol
 
 	msg.body.voltage = voltage;
 	msg.type = MSG_SET_VOLTAGE;
-	vtunerc_ctrldev_xchange_message(ctx, &msg, 1);
+	dvb_proxyfe_xchange(ctx, &msg);
 
 	return 0;
 }
@@ -328,7 +364,7 @@ static int dvb_proxyfe_send_diseqc_msg(struct dvb_frontend *fe, struct dvb_diseq
 
 	memcpy(&msg.body.diseqc_master_cmd, cmd, sizeof(struct dvb_diseqc_master_cmd));
 	msg.type = MSG_SEND_DISEQC_MSG;
-	vtunerc_ctrldev_xchange_message(ctx, &msg, 1);
+	dvb_proxyfe_xchange(ctx, &msg);
 
 	return 0;
 }
@@ -341,7 +377,7 @@ static int dvb_proxyfe_send_diseqc_burst(struct dvb_frontend *fe, fe_sec_mini_cm
 
 	msg.body.burst = burst;
 	msg.type = MSG_SEND_DISEQC_BURST;
-	vtunerc_ctrldev_xchange_message(ctx, &msg, 1);
+	dvb_proxyfe_xchange(ctx, &msg);
 
 	return 0;
 }
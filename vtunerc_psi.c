@@ -0,0 +1,486 @@
+/*
+ * vtunerc: PSI section cache
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Keeps the latest PAT, PMTs, NIT actual and SDT actual seen in the
+ * injected TS, so that a section filter started on one of these PIDs
+ * gets them at once instead of waiting for the next repetition.
+ *
+ * Sections are assembled on the write path (tswrite_sem) for the PIDs
+ * in ctx->psimap: 0x00, 0x10, 0x11 and the PMT PIDs listed by the PAT.
+ * A new version replaces the stored one once its CRC is checked;
+ * psi->lock guards the stored sections against delivery. Retuning
+ * drops them all, the write path then restarts the assembly. A new
+ * PAT version drops the PMT PIDs and sections of the old one, and a
+ * full store makes room by dropping the section seen least recently.
+ *
+ * dmxdev ignores sections until the filter is set to GO, which happens
+ * only after start_feed returned, so delivery is left to a work item
+ * waiting for that. The pending feeds are kept under demux.lock, the
+ * lock the demux itself holds while calling section callbacks.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/crc32.h>
+
+#include "vtunerc_priv.h"
+
+#define VTUNERC_PSI_SECLEN	1024	/* longest PSI section */
+#define VTUNERC_PSI_SECTIONS	64
+#define VTUNERC_PSI_PIDS	32	/* assembled at the same time */
+#define VTUNERC_PSI_TRIES	10	/* jiffies waiting for dmxdev */
+
+struct vtunerc_psi_sec {
+	u16 pid;
+	u16 len;		/* 0 = free */
+	u8 version;
+	u32 seen;		/* psi->clock when last seen */
+	u8 data[VTUNERC_PSI_SECLEN];
+};
+
+struct vtunerc_psi_asm {
+	u16 pid;		/* PID_UNKNOWN = free */
+	u16 len;
+	u16 need;
+	u8 cc;
+	u8 cc_valid;
+	u8 data[VTUNERC_PSI_SECLEN];
+};
+
+struct vtunerc_psi_pending {
+	struct dvb_demux_feed *feed;
+	int tries;
+};
+
+struct vtunerc_psi {
+	struct vtunerc_ctx *ctx;
+	spinlock_t lock;
+	int flush;		/* retuned, the write path has to restart */
+	u8 pat_version;		/* 0xff = none yet */
+	u32 clock;		/* sections stored or seen */
+	struct vtunerc_psi_asm as[VTUNERC_PSI_PIDS];
+	struct vtunerc_psi_sec sec[VTUNERC_PSI_SECTIONS];
+	struct vtunerc_psi_pending pending[MAX_PIDTAB_LEN];
+	int npending;
+	struct delayed_work work;
+};
+
+/* PAT on 0x00, NIT actual on 0x10, SDT actual on 0x11, PMT elsewhere */
+static int vtunerc_psi_wanted(u16 pid, u8 table_id)
+{
+	switch (pid) {
+	case 0x0000:
+		return table_id == 0x00;
+	case 0x0010:
+		return table_id == 0x40;
+	case 0x0011:
+		return table_id == 0x42;
+	default:
+		return table_id == 0x02;
+	}
+}
+
+static int vtunerc_psi_fixed(u16 pid)
+{
+	return pid == 0x0000 || pid == 0x0010 || pid == 0x0011;
+}
+
+/* back to the fixed PIDs only, caller holds tswrite_sem */
+static void vtunerc_psi_unfollow(struct vtunerc_ctx *ctx)
+{
+	struct vtunerc_psi *psi = ctx->psi;
+	int i;
+
+	for (i = 0; i < VTUNERC_PSI_PIDS; i++)
+		if (!vtunerc_psi_fixed(psi->as[i].pid))
+			psi->as[i].pid = PID_UNKNOWN;
+
+	bitmap_zero(ctx->psimap, 0x2000);
+	set_bit(0x0000, ctx->psimap);
+	set_bit(0x0010, ctx->psimap);
+	set_bit(0x0011, ctx->psimap);
+}
+
+/* caller holds tswrite_sem */
+static void vtunerc_psi_flush(struct vtunerc_ctx *ctx)
+{
+	struct vtunerc_psi *psi = ctx->psi;
+	int i;
+
+	for (i = 0; i < VTUNERC_PSI_PIDS; i++)
+		psi->as[i].pid = PID_UNKNOWN;
+	vtunerc_psi_unfollow(ctx);
+	psi->pat_version = 0xff;
+
+	spin_lock(&psi->lock);
+	psi->flush = 0;
+	spin_unlock(&psi->lock);
+}
+
+/*
+ * follow the PMT PIDs of the programs; a new PAT version forgets
+ * those of the old one, the sections of all its parts then add theirs
+ */
+static void vtunerc_psi_pat(struct vtunerc_ctx *ctx, const u8 *sec, size_t len)
+{
+	struct vtunerc_psi *psi = ctx->psi;
+	const u8 *p, *end = sec + len - 4;
+	u8 version = (sec[5] >> 1) & 0x1f;
+	int i;
+
+	if (version != psi->pat_version) {
+		if (psi->pat_version != 0xff) {
+			vtunerc_psi_unfollow(ctx);
+			spin_lock(&psi->lock);
+			for (i = 0; i < VTUNERC_PSI_SECTIONS; i++)
+				if (psi->sec[i].len &&
+						!vtunerc_psi_fixed(psi->sec[i].pid))
+					psi->sec[i].len = 0;
+			spin_unlock(&psi->lock);
+		}
+		psi->pat_version = version;
+	}
+
+	for (p = sec + 8; p + 4 <= end; p += 4)
+		if (p[0] | p[1])
+			set_bit(((p[2] & 0x1f) << 8) | p[3], ctx->psimap);
+}
+
+static void vtunerc_psi_store(struct vtunerc_ctx *ctx, u16 pid,
+				const u8 *data, size_t len)
+{
+	struct vtunerc_psi *psi = ctx->psi;
+	struct vtunerc_psi_sec *s, *free = NULL, *old = NULL;
+	u8 version = (data[5] >> 1) & 0x1f;
+
+	/* long syntax, current tables only */
+	if (!vtunerc_psi_wanted(pid, data[0]) || !(data[1] & 0x80) ||
+			!(data[5] & 0x01))
+		return;
+
+	/* same table, extension and section number */
+	for (s = psi->sec; s < psi->sec + VTUNERC_PSI_SECTIONS; s++) {
+		if (!s->len) {
+			if (!free)
+				free = s;
+			continue;
+		}
+		if (s->pid == pid && s->data[0] == data[0] &&
+				s->data[3] == data[3] && s->data[4] == data[4] &&
+				s->data[6] == data[6])
+			break;
+		if (!old || (s32)(s->seen - old->seen) < 0)
+			old = s;
+	}
+
+	if (s == psi->sec + VTUNERC_PSI_SECTIONS) {
+		/* full, the least recently seen one makes room */
+		s = free ? free : old;
+	} else if (s->version == version && s->len == len) {
+		s->seen = ++psi->clock;
+		return;		/* just repeated */
+	}
+
+	if (!s || crc32_be(~0, data, len))
+		return;
+
+	spin_lock(&psi->lock);
+	if (!psi->flush) {
+		memcpy(s->data, data, len);
+		s->pid = pid;
+		s->version = version;
+		s->len = len;
+		s->seen = ++psi->clock;
+	}
+	spin_unlock(&psi->lock);
+
+	if (data[0] == 0x00)
+		vtunerc_psi_pat(ctx, data, len);
+}
+
+/*
+ * append payload to the section being assembled; new sections may
+ * only begin when the packet has payload_unit_start set
+ */
+static void vtunerc_psi_push(struct vtunerc_ctx *ctx, struct vtunerc_psi_asm *a,
+				const u8 *buf, size_t len, int start)
+{
+	size_t n;
+
+	while (len) {
+		if (!a->len && (!start || buf[0] == 0xff))
+			return;		/* stuffing */
+
+		if (a->len < 3)
+			n = min_t(size_t, len, 3 - a->len);
+		else
+			n = min_t(size_t, len, a->need - a->len);
+		memcpy(a->data + a->len, buf, n);
+		a->len += n;
+		buf += n;
+		len -= n;
+
+		if (a->len == 3) {
+			a->need = 3 + (((a->data[1] & 0x0f) << 8) | a->data[2]);
+			if (a->need < 12 || a->need > VTUNERC_PSI_SECLEN)
+				a->len = 0;
+		} else if (a->len == a->need) {
+			vtunerc_psi_store(ctx, a->pid, a->data, a->len);
+			a->len = 0;
+		}
+	}
+}
+
+static struct vtunerc_psi_asm *vtunerc_psi_slot(struct vtunerc_psi *psi,
+						u16 pid)
+{
+	struct vtunerc_psi_asm *a, *free = NULL;
+
+	for (a = psi->as; a < psi->as + VTUNERC_PSI_PIDS; a++) {
+		if (a->pid == pid)
+			return a;
+		if (!free && a->pid == PID_UNKNOWN)
+			free = a;
+	}
+
+	if (free) {
+		free->pid = pid;
+		free->len = 0;
+		free->cc_valid = 0;
+	}
+
+	return free;
+}
+
+/* a TS packet of a PID in ctx->psimap, caller holds tswrite_sem */
+void vtunerc_psi_ts(struct vtunerc_ctx *ctx, const u8 *p)
+{
+	struct vtunerc_psi *psi = ctx->psi;
+	unsigned int pid = ((p[1] & 0x1f) << 8) | p[2];
+	unsigned int off = 4, ptr;
+	struct vtunerc_psi_asm *a;
+	u8 cc = p[3] & 0x0f;
+
+	if (unlikely(psi->flush)) {
+		vtunerc_psi_flush(ctx);
+		if (!test_bit(pid, ctx->psimap))
+			return;
+	}
+
+	/* TEI or no payload */
+	if ((p[1] & 0x80) || !(p[3] & 0x10))
+		return;
+
+	a = vtunerc_psi_slot(psi, pid);
+	if (!a)
+		return;
+
+	if (a->cc_valid && cc != ((a->cc + 1) & 0x0f)) {
+		if (cc == a->cc)
+			return;		/* duplicate */
+		a->len = 0;
+	}
+	a->cc = cc;
+	a->cc_valid = 1;
+
+	if (p[3] & 0x20)
+		off += 1 + p[4];
+	if (off >= 188) {
+		a->len = 0;
+		return;
+	}
+
+	if (p[1] & 0x40) {
+		ptr = p[off++];
+		if (off + ptr > 188) {
+			a->len = 0;
+			return;
+		}
+		if (a->len)
+			vtunerc_psi_push(ctx, a, p + off, ptr, 0);
+		a->len = 0;
+		off += ptr;
+	} else if (!a->len) {
+		return;
+	}
+
+	vtunerc_psi_push(ctx, a, p + off, 188 - off, p[1] & 0x40);
+}
+
+/* as dvb_demux matches section filters */
+static int vtunerc_psi_match(struct dvb_demux_filter *f, const u8 *sec)
+{
+	u8 neq = 0, xor;
+	int i;
+
+	for (i = 0; i < DVB_DEMUX_MASK_MAX; i++) {
+		xor = f->filter.filter_value[i] ^ sec[i];
+		if (f->maskandmode[i] & xor)
+			return 0;
+		neq |= f->maskandnotmode[i] & xor;
+	}
+
+	return !f->doneq || neq;
+}
+
+static int vtunerc_psi_ready(struct dvb_demux_feed *feed)
+{
+	struct dmxdev_filter *dmxdevfilter;
+
+	if (feed->state != DMX_STATE_GO || !feed->filter)
+		return 0;
+
+	dmxdevfilter = feed->filter->filter.priv;
+
+	return dmxdevfilter && dmxdevfilter->state == DMXDEV_STATE_GO;
+}
+
+/* caller holds demux.lock */
+static void vtunerc_psi_deliver(struct vtunerc_psi *psi,
+				struct dvb_demux_feed *feed)
+{
+	struct vtunerc_psi_sec *s;
+	struct dvb_demux_filter *f;
+
+	spin_lock(&psi->lock);
+	for (s = psi->sec; s < psi->sec + VTUNERC_PSI_SECTIONS; s++) {
+		if (!s->len || s->pid != feed->pid)
+			continue;
+		for (f = feed->filter; f; f = f->next)
+			if (vtunerc_psi_match(f, s->data))
+				vtunerc_dmx_sec_cb(feed, f, s->data, s->len);
+	}
+	spin_unlock(&psi->lock);
+}
+
+static void vtunerc_psi_work(struct work_struct *work)
+{
+	struct vtunerc_psi *psi = container_of(to_delayed_work(work),
+						struct vtunerc_psi, work);
+	struct dvb_demux *demux = &psi->ctx->demux;
+	struct vtunerc_psi_pending *pe;
+	unsigned long flags;
+	int i = 0, again = 0;
+
+	spin_lock_irqsave(&demux->lock, flags);
+	while (i < psi->npending) {
+		pe = &psi->pending[i];
+		if (vtunerc_psi_ready(pe->feed)) {
+			vtunerc_psi_deliver(psi, pe->feed);
+		} else if (++pe->tries < VTUNERC_PSI_TRIES) {
+			again = 1;
+			i++;
+			continue;
+		}
+		*pe = psi->pending[--psi->npending];
+	}
+	spin_unlock_irqrestore(&demux->lock, flags);
+
+	if (again)
+		schedule_delayed_work(&psi->work, 1);
+}
+
+/* called from start_feed, the demux mutex is held */
+void vtunerc_psi_start_feed(struct vtunerc_ctx *ctx,
+				struct dvb_demux_feed *feed)
+{
+	struct vtunerc_psi *psi = ctx->psi;
+	unsigned long flags;
+	int i;
+
+	if (!psi || feed->type != DMX_TYPE_SEC || feed->pid >= 0x2000 ||
+			!test_bit(feed->pid, ctx->psimap))
+		return;
+
+	spin_lock_irqsave(&ctx->demux.lock, flags);
+	for (i = 0; i < psi->npending; i++)
+		if (psi->pending[i].feed == feed)
+			break;
+	if (i < MAX_PIDTAB_LEN) {
+		psi->pending[i].feed = feed;
+		psi->pending[i].tries = 0;
+		if (i == psi->npending)
+			psi->npending++;
+	}
+	spin_unlock_irqrestore(&ctx->demux.lock, flags);
+
+	schedule_delayed_work(&psi->work, 0);
+}
+
+void vtunerc_psi_stop_feed(struct vtunerc_ctx *ctx,
+				struct dvb_demux_feed *feed)
+{
+	struct vtunerc_psi *psi = ctx->psi;
+	unsigned long flags;
+	int i;
+
+	if (!psi)
+		return;
+
+	spin_lock_irqsave(&ctx->demux.lock, flags);
+	for (i = 0; i < psi->npending; i++)
+		if (psi->pending[i].feed == feed) {
+			psi->pending[i] = psi->pending[--psi->npending];
+			break;
+		}
+	spin_unlock_irqrestore(&ctx->demux.lock, flags);
+}
+
+/* retune, nothing cached belongs to the new transponder */
+void vtunerc_psi_reset(struct vtunerc_ctx *ctx)
+{
+	struct vtunerc_psi *psi = ctx->psi;
+	int i;
+
+	if (!psi)
+		return;
+
+	spin_lock(&psi->lock);
+	for (i = 0; i < VTUNERC_PSI_SECTIONS; i++)
+		psi->sec[i].len = 0;
+	psi->flush = 1;
+	spin_unlock(&psi->lock);
+}
+
+int vtunerc_psi_init(struct vtunerc_ctx *ctx)
+{
+	struct vtunerc_psi *psi;
+
+	if (!ctx->config->psicache)
+		return 0;
+
+	psi = vzalloc(sizeof(*psi));
+	if (!psi)
+		return -ENOMEM;
+
+	psi->ctx = ctx;
+	spin_lock_init(&psi->lock);
+	INIT_DELAYED_WORK(&psi->work, vtunerc_psi_work);
+	ctx->psi = psi;
+	vtunerc_psi_flush(ctx);
+
+	return 0;
+}
+
+void vtunerc_psi_exit(struct vtunerc_ctx *ctx)
+{
+	if (!ctx->psi)
+		return;
+
+	cancel_delayed_work_sync(&ctx->psi->work);
+	vfree(ctx->psi);
+	ctx->psi = NULL;
+}
@@ -0,0 +1,286 @@
+/*
+ * vtunerc: daemon reconnect
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Remembers what the daemon was last asked to do - the SEC requests
+ * and frontend parameters of the last tune; the pidtab outlives the
+ * sessions anyway, the section filters are taken from the running
+ * feeds - and sends it again to a daemon that opened the control
+ * device with no other one attached. A restarted daemon so picks up
+ * the service without the client having to retune.
+ *
+ * The replay starts at the first VTUNER_SET_TYPE of the session, the
+ * daemon is set up then: a mailbox, framed responses and section
+ * filters are used when they were asked for before it. It runs from
+ * a work item and waits for the responses like the original requests
+ * did: legacy daemons answer every frontend request, and a response
+ * nobody waits for would be taken by the next one. xchange_sem keeps
+ * it in line with the frontend thread; a tune made in the meantime
+ * makes the stale one be skipped. A daemon not answering within
+ * VTUNERC_RESUME_WAIT ms ends the replay, nothing waits on it longer.
+ *
+ * For config->grace ms after the last daemon went away, and while the
+ * replay is due or runs, status reads are answered with the last
+ * responses, so clients don't see a signal loss for a daemon restart.
+ *
+ * res->lock guards the saved messages, the frontend ops noting them
+ * are serialized by dvb_frontend.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/jiffies.h>
+#include <linux/workqueue.h>
+
+#include "vtunerc_priv.h"
+
+#define VTUNERC_RESUME_SEC	8	/* SEC requests kept for a tune */
+#define VTUNERC_RESUME_WAIT	2000	/* ms for each replayed request */
+#define VTUNERC_RESUME_READS	(MSG_READ_UCBLOCKS - MSG_READ_STATUS + 1)
+
+struct vtunerc_resume {
+	struct vtunerc_ctx *ctx;
+	spinlock_t lock;
+	struct vtuner_message fe;	/* last MSG_SET_FRONTEND */
+	u8 fe_vtype;			/* VT_NULL = none */
+	u32 fe_gen;			/* bumped by every tune */
+	struct vtuner_message sec[VTUNERC_RESUME_SEC];
+	int nsec;
+	int sec_tuned;			/* next SEC request starts over */
+	struct vtuner_message rd[VTUNERC_RESUME_READS];
+	unsigned long rd_valid;		/* bit per MSG_READ_* */
+	unsigned long hold_until;	/* jiffies */
+	int armed;			/* replay due at VTUNER_SET_TYPE */
+	int pending;			/* replay queued or running */
+	struct work_struct work;
+};
+
+static int vtunerc_resume_is_sec(int type)
+{
+	switch (type) {
+	case MSG_SET_TONE:
+	case MSG_SET_VOLTAGE:
+	case MSG_ENABLE_HIGH_VOLTAGE:
+	case MSG_SEND_DISEQC_MSG:
+	case MSG_SEND_DISEQC_BURST:
+		return 1;
+	}
+
+	return 0;
+}
+
+static int vtunerc_resume_is_read(int type)
+{
+	return type >= MSG_READ_STATUS && type <= MSG_READ_UCBLOCKS;
+}
+
+/* frontend request about to be sent */
+void vtunerc_resume_note(struct vtunerc_ctx *ctx,
+				const struct vtuner_message *msg)
+{
+	struct vtunerc_resume *res = ctx->resume;
+
+	if (!res)
+		return;
+
+	spin_lock(&res->lock);
+	if (msg->type == MSG_SET_FRONTEND) {
+		memcpy(&res->fe, msg, sizeof(*msg));
+		res->fe_vtype = ctx->vtype;
+		res->fe_gen++;
+		res->sec_tuned = 1;
+		res->rd_valid = 0;
+	} else if (vtunerc_resume_is_sec(msg->type)) {
+		if (res->sec_tuned) {
+			res->nsec = 0;
+			res->sec_tuned = 0;
+		}
+		/* keep the newest ones */
+		if (res->nsec == VTUNERC_RESUME_SEC)
+			memmove(&res->sec[0], &res->sec[1],
+				--res->nsec * sizeof(res->sec[0]));
+		memcpy(&res->sec[res->nsec++], msg, sizeof(*msg));
+	}
+	spin_unlock(&res->lock);
+}
+
+/* response to a status read came from a daemon */
+void vtunerc_resume_answer(struct vtunerc_ctx *ctx, int type,
+				const struct vtuner_message *msg)
+{
+	struct vtunerc_resume *res = ctx->resume;
+
+	if (!res || !vtunerc_resume_is_read(type) ||
+			ctx->fd_opened < 1 || ctx->closing)
+		return;
+
+	spin_lock(&res->lock);
+	memcpy(&res->rd[type - MSG_READ_STATUS], msg, sizeof(*msg));
+	set_bit(type - MSG_READ_STATUS, &res->rd_valid);
+	spin_unlock(&res->lock);
+}
+
+/*
+ * answer a status read from the saved response while the daemon is
+ * away or being brought up to date, returns 1 when it did
+ */
+int vtunerc_resume_hold(struct vtunerc_ctx *ctx, struct vtuner_message *msg)
+{
+	struct vtunerc_resume *res = ctx->resume;
+	int type = msg->type;
+	int ret = 0;
+
+	if (!res || !ctx->config->grace || !vtunerc_resume_is_read(type))
+		return 0;
+
+	spin_lock(&res->lock);
+	if (test_bit(type - MSG_READ_STATUS, &res->rd_valid) &&
+			(res->pending || ((ctx->fd_opened < 1 || res->armed) &&
+				time_before(jiffies, res->hold_until)))) {
+		memcpy(msg, &res->rd[type - MSG_READ_STATUS], sizeof(*msg));
+		msg->type = type;
+		ret = 1;
+	}
+	spin_unlock(&res->lock);
+
+	return ret;
+}
+
+static void vtunerc_resume_work(struct work_struct *work)
+{
+	struct vtunerc_resume *res = container_of(work, struct vtunerc_resume,
+							work);
+	struct vtunerc_ctx *ctx = res->ctx;
+	long timeout = msecs_to_jiffies(VTUNERC_RESUME_WAIT);
+	struct vtuner_message *sec, msg;
+	int i, nsec, tune, ret = 0;
+	u32 gen;
+
+	sec = kmalloc(VTUNERC_RESUME_SEC * sizeof(*sec), GFP_KERNEL);
+	if (!sec)
+		goto out;
+
+	spin_lock(&res->lock);
+	nsec = res->nsec;
+	memcpy(sec, res->sec, nsec * sizeof(*sec));
+	tune = res->fe_vtype != VT_NULL && res->fe_vtype == ctx->vtype;
+	memcpy(&msg, &res->fe, sizeof(msg));
+	gen = res->fe_gen;
+	spin_unlock(&res->lock);
+
+	dprintk(ctx, "replaying %d SEC requests%s\n", nsec,
+			tune ? " and the tune" : "");
+
+	for (i = 0; i < nsec && !ret; i++)
+		ret = vtunerc_ctrldev_xchange_timeout(ctx, &sec[i], 1, timeout);
+	kfree(sec);
+
+	/* a newer tune has been sent already */
+	spin_lock(&res->lock);
+	tune = tune && gen == res->fe_gen;
+	spin_unlock(&res->lock);
+	if (tune && !ret)
+		ret = vtunerc_ctrldev_xchange_timeout(ctx, &msg, 1, timeout);
+
+	mutex_lock(&ctx->demux.mutex);
+	if (ctx->pidtab_len && !ret) {
+		vtunerc_pidtab_to_msg(ctx, &msg);
+		ret = vtunerc_ctrldev_xchange_timeout(ctx, &msg, 0, timeout);
+	}
+	if (!ret)
+		ret = vtunerc_secfilter_resend(ctx, timeout);
+	mutex_unlock(&ctx->demux.mutex);
+
+	if (ret == -ETIMEDOUT)
+		printk(KERN_NOTICE "vtunerc%d: daemon not answering, replay given up\n",
+				ctx->idx);
+
+out:
+	spin_lock(&res->lock);
+	res->pending = 0;
+	spin_unlock(&res->lock);
+}
+
+/* the first daemon opened the control device */
+void vtunerc_resume_connect(struct vtunerc_ctx *ctx)
+{
+	struct vtunerc_resume *res = ctx->resume;
+
+	if (!res)
+		return;
+
+	spin_lock(&res->lock);
+	res->armed = 1;
+	spin_unlock(&res->lock);
+}
+
+/* the daemon set the tuner type, once per session */
+void vtunerc_resume_start(struct vtunerc_ctx *ctx)
+{
+	struct vtunerc_resume *res = ctx->resume;
+
+	if (!res)
+		return;
+
+	spin_lock(&res->lock);
+	if (res->armed && !res->pending &&
+			(res->fe_vtype != VT_NULL || res->nsec || ctx->pidtab_len)) {
+		res->pending = 1;
+		/* may wait on the daemon for a while */
+		queue_work(system_long_wq, &res->work);
+	}
+	res->armed = 0;
+	spin_unlock(&res->lock);
+}
+
+/* the last daemon went away */
+void vtunerc_resume_disconnect(struct vtunerc_ctx *ctx)
+{
+	struct vtunerc_resume *res = ctx->resume;
+
+	if (!res)
+		return;
+
+	spin_lock(&res->lock);
+	res->armed = 0;
+	res->hold_until = jiffies + msecs_to_jiffies(ctx->config->grace);
+	spin_unlock(&res->lock);
+}
+
+int vtunerc_resume_init(struct vtunerc_ctx *ctx)
+{
+	struct vtunerc_resume *res;
+
+	res = kzalloc(sizeof(*res), GFP_KERNEL);
+	if (!res)
+		return -ENOMEM;
+
+	res->ctx = ctx;
+	spin_lock_init(&res->lock);
+	INIT_WORK(&res->work, vtunerc_resume_work);
+	res->hold_until = jiffies;
+	ctx->resume = res;
+
+	return 0;
+}
+
+void vtunerc_resume_exit(struct vtunerc_ctx *ctx)
+{
+	if (!ctx->resume)
+		return;
+
+	cancel_work_sync(&ctx->resume->work);
+	kfree(ctx->resume);
+	ctx->resume = NULL;
+}
@@ -0,0 +1,163 @@
+/*
+ * vtunerc: section filter offload
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Tells a VTUNER_CAP_SECFILTER daemon which sections of a PID are
+ * wanted, so EIT and the like need not cross the link whole.
+ *
+ * dmxdev shares one section feed among the filters of a PID and
+ * restarts it whenever a filter comes or goes, so start/stop_feed
+ * always see the full filter set. The local demux still filters, the
+ * daemon only has to send a superset.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/string.h>
+#include <linux/sched.h>
+
+#include "vtunerc_priv.h"
+
+static int vtunerc_secfilter_send(struct vtunerc_ctx *ctx, u16 pid, u8 op,
+					struct dvb_demux_filter *df, long timeout)
+{
+	struct vtuner_message msg;
+	int i;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = MSG_SECFILTER;
+	msg.body.secfilter.pid = pid;
+	msg.body.secfilter.op = op;
+
+	/*
+	 * demux layout back to the API one: byte 0 is table_id, the
+	 * section length bytes 1-2 are skipped, mode is inverted
+	 */
+	if (df) {
+		for (i = 0; i < DMX_FILTER_SIZE; i++) {
+			int k = i ? i + 2 : 0;
+
+			msg.body.secfilter.filter[i] = df->filter.filter_value[k];
+			msg.body.secfilter.mask[i] = df->filter.filter_mask[k];
+			msg.body.secfilter.mode[i] = ~df->filter.filter_mode[k];
+		}
+	}
+
+	return vtunerc_ctrldev_xchange_timeout(ctx, &msg, 0, timeout);
+}
+
+static int vtunerc_secfilter_add_feed(struct vtunerc_ctx *ctx,
+					struct dvb_demux_feed *f, long timeout)
+{
+	struct dvb_demux_filter *df;
+	int ret = 0;
+
+	for (df = f->filter; df && !ret; df = df->next)
+		ret = vtunerc_secfilter_send(ctx, f->pid, VTUNER_SECFILTER_ADD,
+						df, timeout);
+
+	return ret;
+}
+
+/*
+ * bring the daemon's filters of feed->pid up to date: those of all
+ * section feeds running on it, none when a TS feed takes the PID whole.
+ * Called from start/stop_feed with the demux mutex held, the feed
+ * itself is not marked running or stopped yet.
+ */
+void vtunerc_secfilter_update(struct vtunerc_ctx *ctx,
+				struct dvb_demux_feed *feed, int start)
+{
+	struct dvb_demux_feed *f;
+	u16 pid = feed->pid;
+	int whole = 0, nsec = 0;
+
+	if (!(ctx->proto_caps & VTUNER_CAP_SECFILTER) || pid >= 0x2000)
+		return;
+
+	list_for_each_entry(f, &ctx->demux.feed_list, list_head) {
+		if (f == feed || f->pid != pid || f->state != DMX_STATE_GO)
+			continue;
+		if (f->type == DMX_TYPE_SEC)
+			nsec++;
+		else
+			whole = 1;
+	}
+	if (start) {
+		if (feed->type == DMX_TYPE_SEC)
+			nsec++;
+		else
+			whole = 1;
+	}
+
+	if (test_bit(pid, ctx->secmap)) {
+		vtunerc_secfilter_send(ctx, pid, VTUNER_SECFILTER_CLEAR, NULL,
+					MAX_SCHEDULE_TIMEOUT);
+		clear_bit(pid, ctx->secmap);
+	}
+
+	if (whole || !nsec)
+		return;
+
+	list_for_each_entry(f, &ctx->demux.feed_list, list_head)
+		if (f != feed && f->pid == pid && f->type == DMX_TYPE_SEC &&
+				f->state == DMX_STATE_GO)
+			vtunerc_secfilter_add_feed(ctx, f, MAX_SCHEDULE_TIMEOUT);
+	if (start)
+		vtunerc_secfilter_add_feed(ctx, feed, MAX_SCHEDULE_TIMEOUT);
+	set_bit(pid, ctx->secmap);
+
+	dprintk(ctx, "filters of %d section feeds on PID 0x%x sent\n",
+			nsec, pid);
+}
+
+/*
+ * the daemon's filters went with it: send those of the running section
+ * feeds to a new one, with the demux mutex held. Without them the PIDs
+ * come whole, so a daemon that discovers later only misses the savings
+ * until the filters of a PID change.
+ */
+int vtunerc_secfilter_resend(struct vtunerc_ctx *ctx, long timeout)
+{
+	struct dvb_demux_feed *feed, *f;
+	int whole, ret = 0;
+	u16 pid;
+
+	if (!(ctx->proto_caps & VTUNER_CAP_SECFILTER))
+		return 0;
+
+	list_for_each_entry(feed, &ctx->demux.feed_list, list_head) {
+		pid = feed->pid;
+		if (feed->type != DMX_TYPE_SEC || feed->state != DMX_STATE_GO ||
+				pid >= 0x2000 || test_bit(pid, ctx->secmap))
+			continue;
+
+		whole = 0;
+		list_for_each_entry(f, &ctx->demux.feed_list, list_head)
+			if (f->pid == pid && f->type != DMX_TYPE_SEC &&
+					f->state == DMX_STATE_GO)
+				whole = 1;
+		if (whole)
+			continue;
+
+		list_for_each_entry(f, &ctx->demux.feed_list, list_head)
+			if (f->pid == pid && f->type == DMX_TYPE_SEC &&
+					f->state == DMX_STATE_GO && !ret)
+				ret = vtunerc_secfilter_add_feed(ctx, f, timeout);
+		if (ret)
+			break;
+		set_bit(pid, ctx->secmap);
+	}
+
+	return ret;
+}
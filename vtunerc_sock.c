@@ -0,0 +1,185 @@
+/*
+ * vtunerc: In-kernel TS socket receiver
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * The daemon can hand a connected TCP or UDP socket over by
+ * VTUNER_SET_TS_SOCKET. The TS is then received by a kernel thread
+ * and fed to the demux directly, without the round trip through
+ * the daemon and write(). Control messages stay in the daemon.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/kthread.h>
+#include <linux/net.h>
+#include <linux/vmalloc.h>
+#include <linux/sched.h>
+#include <net/sock.h>
+
+#include "vtunerc_priv.h"
+
+#define VTUNERC_SOCK_BUFSIZE	65535		/* fits max UDP datagram */
+#define RTP_HDR_LEN		12
+
+/* number of bytes before the first TS sync in a stream */
+static size_t vtunerc_sock_resync(const u8 *buf, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len && buf[i] != 0x47)
+		i++;
+
+	return i;
+}
+
+static int vtunerc_sock_thread(void *data)
+{
+	struct vtunerc_ctx *ctx = data;
+	struct socket *sock = ctx->ts_sock;
+	int stream = sock->type == SOCK_STREAM;
+	struct msghdr msg;
+	struct kvec iov;
+	size_t rem = 0, len, skip, cut;
+	u8 *buf;
+	int ret, trunc;
+
+	buf = vmalloc(VTUNERC_SOCK_BUFSIZE);
+	if (!buf) {
+		printk(KERN_ERR "vtunerc%d: no memory for socket buffer\n",
+				ctx->idx);
+		goto idle;
+	}
+
+	while (!kthread_should_stop()) {
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = buf + rem;
+		iov.iov_len = VTUNERC_SOCK_BUFSIZE - rem;
+
+		ret = kernel_recvmsg(sock, &msg, &iov, 1, iov.iov_len, 0);
+		if (ret < 0) {
+			if (ret == -EAGAIN || ret == -EINTR || ret == -ERESTARTSYS)
+				continue;
+			printk(KERN_ERR "vtunerc%d: socket receive error %d\n",
+					ctx->idx, ret);
+			break;
+		}
+		if (ret == 0) {
+			if (stream || kthread_should_stop())
+				break;
+			continue;
+		}
+
+		/* only a jumbogram gets here, its tail is gone */
+		trunc = !stream && (msg.msg_flags & MSG_TRUNC);
+
+		len = rem + ret;
+		skip = 0;
+
+		if (!stream && len % 188 == RTP_HDR_LEN && (buf[0] >> 6) == 2)
+			skip = RTP_HDR_LEN; /* plain RTP header */
+		else if (buf[0] != 0x47)
+			skip = vtunerc_sock_resync(buf, len);
+
+		len -= skip;
+		rem = stream ? len % 188 : 0;
+		cut = stream ? 0 : len % 188;
+		len -= len % 188;
+
+		/* a datagram is lost past its last whole packet */
+		if (cut || trunc)
+			dprintk(ctx, "datagram of %d bytes cut by %zu%s\n",
+					ret, cut, trunc ? ", truncated" : "");
+
+		if (len || cut || trunc)
+			vtunerc_ctrldev_ingest(ctx, buf + skip, len,
+						cut || trunc);
+
+		if (rem)
+			memmove(buf, buf + skip + len, rem);
+	}
+
+	vfree(buf);
+
+idle:
+	/* kthread_stop() needs us alive */
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+
+	return 0;
+}
+
+void vtunerc_sock_stop(struct vtunerc_ctx *ctx)
+{
+	mutex_lock(&ctx->ts_sock_mutex);
+
+	if (ctx->ts_thread) {
+		/* wakes up the receiver */
+		kernel_sock_shutdown(ctx->ts_sock, SHUT_RDWR);
+		kthread_stop(ctx->ts_thread);
+		ctx->ts_thread = NULL;
+		printk(KERN_NOTICE "vtunerc%d: TS socket receiver stopped\n",
+				ctx->idx);
+	}
+
+	if (ctx->ts_sock) {
+		sockfd_put(ctx->ts_sock);
+		ctx->ts_sock = NULL;
+	}
+
+	mutex_unlock(&ctx->ts_sock_mutex);
+}
+
+int vtunerc_sock_start(struct vtunerc_ctx *ctx, int fd)
+{
+	struct socket *sock;
+	int ret;
+
+	vtunerc_sock_stop(ctx);
+
+	if (fd < 0)
+		return 0;
+
+	sock = sockfd_lookup(fd, &ret);
+	if (!sock)
+		return ret;
+
+	if (sock->type != SOCK_STREAM && sock->type != SOCK_DGRAM) {
+		sockfd_put(sock);
+		return -EINVAL;
+	}
+
+	mutex_lock(&ctx->ts_sock_mutex);
+
+	ctx->ts_sock = sock;
+	ctx->ts_thread = kthread_run(vtunerc_sock_thread, ctx, "vtunerc%d-ts",
+					ctx->idx);
+	if (IS_ERR(ctx->ts_thread)) {
+		ret = PTR_ERR(ctx->ts_thread);
+		ctx->ts_thread = NULL;
+		ctx->ts_sock = NULL;
+		mutex_unlock(&ctx->ts_sock_mutex);
+		sockfd_put(sock);
+		return ret;
+	}
+
+	mutex_unlock(&ctx->ts_sock_mutex);
+
+	printk(KERN_NOTICE "vtunerc%d: TS socket receiver started (%s)\n",
+			ctx->idx, sock->type == SOCK_STREAM ? "stream" : "datagram");
+
+	return 0;
+}
@@ -0,0 +1,383 @@
+/*
+ * vtunerc: statistics in procfs and debugfs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * /proc/vtunercN is the human readable overview, debugfs
+ * vtunerc/vtunercN/stats carries the same numbers as "name value"
+ * lines for scrapers. Ingest counters are updated under tswrite_sem,
+ * control counters under ctrldev_lock; readers take a consistent
+ * snapshot through u64_stats_sync, so 32-bit hosts see no torn values.
+ * The per-PID counters, the rates and the arrival jitter change once
+ * per packet or batch, they are read under tswrite_sem instead.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/math64.h>
+
+#include "vtunerc_priv.h"
+
+#define VTUNERC_PROC_FILENAME	"vtunerc%i"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+#define vtunerc_pde_data(inode)	pde_data(inode)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
+#define vtunerc_pde_data(inode)	PDE_DATA(inode)
+#else
+#define vtunerc_pde_data(inode)	(PDE(inode)->data)
+#endif
+
+#ifdef CONFIG_DEBUG_FS
+static struct dentry *vtunerc_dbgfs_root;
+#endif
+
+void vtunerc_stats_ts(struct vtunerc_ctx *ctx,
+			const struct vtunerc_ts_stats *st)
+{
+	struct vtunerc_ts_stats *s = &ctx->ts_stats;
+
+	u64_stats_update_begin(&ctx->ts_syncp);
+	s->wr_calls += st->wr_calls;
+	s->wr_bytes += st->wr_bytes;
+	s->drop_null += st->drop_null;
+	s->drop_pid += st->drop_pid;
+	s->drop_sync += st->drop_sync;
+	s->drop_tei += st->drop_tei;
+	s->drop_short += st->drop_short;
+	s->cc_errors += st->cc_errors;
+	u64_stats_update_end(&ctx->ts_syncp);
+}
+
+/* count a request of given type, or a response */
+void vtunerc_stats_msg(struct vtunerc_ctx *ctx, int type, int response)
+{
+	int i = VTUNERC_STAT_MSGTYPES - 1;
+
+	if (type >= 0 && type < VTUNERC_STAT_MSGTYPES - 1)
+		i = type;
+
+	spin_lock(&ctx->ctrldev_lock);
+	u64_stats_update_begin(&ctx->ctrl_syncp);
+	if (response) {
+		ctx->ctrl_stats.responses++;
+	} else {
+		ctx->ctrl_stats.requests++;
+		ctx->ctrl_stats.msgs[i]++;
+	}
+	u64_stats_update_end(&ctx->ctrl_syncp);
+	spin_unlock(&ctx->ctrldev_lock);
+}
+
+void vtunerc_stats_read(struct vtunerc_ctx *ctx, size_t len)
+{
+	spin_lock(&ctx->ctrldev_lock);
+	u64_stats_update_begin(&ctx->ctrl_syncp);
+	ctx->ctrl_stats.rd_bytes += len;
+	u64_stats_update_end(&ctx->ctrl_syncp);
+	spin_unlock(&ctx->ctrldev_lock);
+}
+
+static void vtunerc_stats_fetch(struct vtunerc_ctx *ctx,
+			struct vtunerc_ts_stats *ts,
+			struct vtunerc_ctrl_stats *cs)
+{
+	unsigned int start;
+
+	do {
+		start = u64_stats_fetch_begin(&ctx->ts_syncp);
+		*ts = ctx->ts_stats;
+	} while (u64_stats_fetch_retry(&ctx->ts_syncp, start));
+
+	do {
+		start = u64_stats_fetch_begin(&ctx->ctrl_syncp);
+		*cs = ctx->ctrl_stats;
+	} while (u64_stats_fetch_retry(&ctx->ctrl_syncp, start));
+}
+
+/* bytes waiting in the dvr0 ring, 0 when dvr0 is not open */
+static ssize_t vtunerc_stats_dvr_fill(struct vtunerc_ctx *ctx)
+{
+	struct dvb_ringbuffer *rb = &ctx->dmxdev.dvr_buffer;
+
+	if (!rb->data)
+		return 0;
+
+	return rb->size - 1 - dvb_ringbuffer_free(rb);
+}
+
+/*
+ * next PID from 'pid' on which carries traffic or had errors, 0x2001
+ * when none: under a full TS feed the service PIDs are not requested,
+ * their counters are kept all the same
+ */
+static unsigned int vtunerc_stats_next_pid(struct vtunerc_ctx *ctx,
+						unsigned int pid)
+{
+	struct vtunerc_pidstat *ps;
+
+	for (; pid <= 0x2000; pid++) {
+		ps = &ctx->pidstat[pid];
+		if (ps->active || ps->cc_errors || ps->tei_errors)
+			break;
+	}
+
+	return pid;
+}
+
+static char *get_fe_name(struct dvb_frontend_info *feinfo)
+{
+	return (feinfo && feinfo->name) ? feinfo->name : "(not set)";
+}
+
+static int vtunerc_stats_proc_show(struct seq_file *m, void *v)
+{
+	struct vtunerc_ctx *ctx = m->private;
+	struct vtunerc_ts_stats ts;
+	struct vtunerc_ctrl_stats cs;
+	struct vtunerc_pidstat *ps;
+	unsigned int pid;
+	int i, pcnt = 0;
+
+	vtunerc_ctrldev_rates_refresh(ctx);
+	vtunerc_stats_fetch(ctx, &ts, &cs);
+	if (down_interruptible(&ctx->tswrite_sem))
+		return -ERESTARTSYS;
+
+	seq_printf(m, "[ vtunerc driver, version " VTUNERC_MODULE_VERSION " ]\n");
+	seq_printf(m, "  sessions: %u\n", ctx->stat_ctrl_sess);
+	seq_printf(m, "  TS data : %llu bytes in %llu writes\n",
+			(unsigned long long)ts.wr_bytes,
+			(unsigned long long)ts.wr_calls);
+	if (ctx->pktsize != VTUNER_PKTFMT_188)
+		seq_printf(m, "  pkt fmt : %u bytes\n", ctx->pktsize);
+	if (ctx->pktsize == VTUNER_PKTFMT_192)
+		seq_printf(m, "  arrival : %lld us jitter\n",
+				(long long)div_s64(ctx->stamp_jitter, 1000));
+	seq_printf(m, "  bitrate : %llu kbit/s\n",
+			(unsigned long long)div_u64(ctx->rate, 1000));
+	seq_printf(m, "  dropped : %llu null, %llu unsubscribed\n",
+			(unsigned long long)ts.drop_null,
+			(unsigned long long)ts.drop_pid);
+	if (ts.drop_short)
+		seq_printf(m, "  cut     : %llu datagrams with partial packets\n",
+				(unsigned long long)ts.drop_short);
+	seq_printf(m, "  TS errs : %llu sync, %llu TEI, %llu CC\n",
+			(unsigned long long)ts.drop_sync,
+			(unsigned long long)ts.drop_tei,
+			(unsigned long long)ts.cc_errors);
+
+	seq_puts(m, "  PID tab :");
+	for (i = 0; i < MAX_PIDTAB_LEN; i++)
+		if (ctx->pidtab[i] != PID_UNKNOWN) {
+			seq_printf(m, " %x", ctx->pidtab[i]);
+			pcnt++;
+		}
+	seq_printf(m, " (len=%d)\n", pcnt);
+
+	for (pid = vtunerc_stats_next_pid(ctx, 0); pid <= 0x2000;
+			pid = vtunerc_stats_next_pid(ctx, pid + 1)) {
+		ps = &ctx->pidstat[pid];
+		seq_printf(m, "  PID %4x: %llu pkts, %llu kbit/s, %u CC, %u TEI errors\n",
+				pid, (unsigned long long)ps->packets,
+				(unsigned long long)div_u64(ps->rate, 1000),
+				ps->cc_errors, ps->tei_errors);
+	}
+
+	seq_printf(m, "  FE type : %s\n", get_fe_name(ctx->feinfo));
+	seq_printf(m, "  msg xchg: %u/%d\n",
+			ctx->ctrldev_reqq_head - ctx->ctrldev_reqq_tail,
+			ctx->ctrldev_response.type);
+	seq_printf(m, "  messages: %llu requests, %llu responses, %llu bytes read\n",
+			(unsigned long long)cs.requests,
+			(unsigned long long)cs.responses,
+			(unsigned long long)cs.rd_bytes);
+	seq_printf(m, "  buffers : queue %u/%u msgs, dvr %zd/%zd bytes\n",
+			ctx->ctrldev_reqq_head - ctx->ctrldev_reqq_tail,
+			VTUNERC_CTRLDEV_QLEN, vtunerc_stats_dvr_fill(ctx),
+			ctx->dmxdev.dvr_buffer.size);
+
+	up(&ctx->tswrite_sem);
+
+	vtunerc_dejitter_show(ctx, m, 0);
+
+	return 0;
+}
+
+static int vtunerc_stats_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, vtunerc_stats_proc_show,
+				vtunerc_pde_data(inode));
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+static const struct proc_ops vtunerc_stats_proc_fops = {
+	.proc_open	= vtunerc_stats_proc_open,
+	.proc_read	= seq_read,
+	.proc_lseek	= seq_lseek,
+	.proc_release	= single_release,
+};
+#else
+static const struct file_operations vtunerc_stats_proc_fops = {
+	.owner		= THIS_MODULE,
+	.open		= vtunerc_stats_proc_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif
+
+#ifdef CONFIG_DEBUG_FS
+/* one "name value" pair per line */
+static int vtunerc_stats_raw_show(struct seq_file *m, void *v)
+{
+	struct vtunerc_ctx *ctx = m->private;
+	struct vtunerc_ts_stats ts;
+	struct vtunerc_ctrl_stats cs;
+	struct vtunerc_pidstat *ps;
+	unsigned int pid;
+	int i;
+
+	vtunerc_ctrldev_rates_refresh(ctx);
+	vtunerc_stats_fetch(ctx, &ts, &cs);
+	if (down_interruptible(&ctx->tswrite_sem))
+		return -ERESTARTSYS;
+
+	seq_printf(m, "sessions %u\n", ctx->stat_ctrl_sess);
+	seq_printf(m, "wr_calls %llu\n", (unsigned long long)ts.wr_calls);
+	seq_printf(m, "wr_bytes %llu\n", (unsigned long long)ts.wr_bytes);
+	seq_printf(m, "drop_null %llu\n", (unsigned long long)ts.drop_null);
+	seq_printf(m, "drop_pid %llu\n", (unsigned long long)ts.drop_pid);
+	seq_printf(m, "drop_sync %llu\n", (unsigned long long)ts.drop_sync);
+	seq_printf(m, "drop_tei %llu\n", (unsigned long long)ts.drop_tei);
+	seq_printf(m, "drop_short %llu\n", (unsigned long long)ts.drop_short);
+	seq_printf(m, "cc_errors %llu\n", (unsigned long long)ts.cc_errors);
+	seq_printf(m, "bitrate %llu\n", (unsigned long long)ctx->rate);
+	seq_printf(m, "pktsize %u\n", ctx->pktsize);
+	seq_printf(m, "arrival_jitter_ns %lld\n", (long long)ctx->stamp_jitter);
+	seq_printf(m, "rd_bytes %llu\n", (unsigned long long)cs.rd_bytes);
+	seq_printf(m, "requests %llu\n", (unsigned long long)cs.requests);
+	seq_printf(m, "responses %llu\n", (unsigned long long)cs.responses);
+	for (i = 0; i < VTUNERC_STAT_MSGTYPES - 1; i++)
+		if (cs.msgs[i])
+			seq_printf(m, "msg.%d %llu\n", i,
+					(unsigned long long)cs.msgs[i]);
+	seq_printf(m, "msg.other %llu\n",
+			(unsigned long long)cs.msgs[VTUNERC_STAT_MSGTYPES - 1]);
+	seq_printf(m, "queue_used %u\n",
+			ctx->ctrldev_reqq_head - ctx->ctrldev_reqq_tail);
+	seq_printf(m, "queue_size %u\n", VTUNERC_CTRLDEV_QLEN);
+	seq_printf(m, "dvr_used %zd\n", vtunerc_stats_dvr_fill(ctx));
+	seq_printf(m, "dvr_size %zd\n", ctx->dmxdev.dvr_buffer.size);
+
+	for (pid = vtunerc_stats_next_pid(ctx, 0); pid <= 0x2000;
+			pid = vtunerc_stats_next_pid(ctx, pid + 1)) {
+		ps = &ctx->pidstat[pid];
+		seq_printf(m, "pid.%u.packets %llu\n", pid,
+				(unsigned long long)ps->packets);
+		seq_printf(m, "pid.%u.bitrate %llu\n", pid,
+				(unsigned long long)ps->rate);
+		seq_printf(m, "pid.%u.cc_errors %u\n", pid, ps->cc_errors);
+		seq_printf(m, "pid.%u.tei_errors %u\n", pid, ps->tei_errors);
+	}
+
+	up(&ctx->tswrite_sem);
+
+	vtunerc_dejitter_show(ctx, m, 1);
+
+	return 0;
+}
+
+static int vtunerc_stats_raw_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, vtunerc_stats_raw_show, inode->i_private);
+}
+
+static const struct file_operations vtunerc_stats_raw_fops = {
+	.owner		= THIS_MODULE,
+	.open		= vtunerc_stats_raw_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif
+
+int vtunerc_stats_register(struct vtunerc_ctx *ctx)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0)
+	u64_stats_init(&ctx->ts_syncp);
+	u64_stats_init(&ctx->ctrl_syncp);
+#endif
+
+#ifdef CONFIG_PROC_FS
+	ctx->procname = kasprintf(GFP_KERNEL, VTUNERC_PROC_FILENAME, ctx->idx);
+	if (!ctx->procname ||
+			!proc_create_data(ctx->procname, 0, NULL,
+					&vtunerc_stats_proc_fops, ctx))
+		printk(KERN_WARNING
+			"vtunerc%d: Unable to register '%s' proc file\n",
+			ctx->idx, ctx->procname);
+#endif
+
+#ifdef CONFIG_DEBUG_FS
+	if (vtunerc_dbgfs_root) {
+		char name[16];
+
+		sprintf(name, "vtunerc%d", ctx->idx);
+		ctx->dbgfs = debugfs_create_dir(name, vtunerc_dbgfs_root);
+		if (!IS_ERR_OR_NULL(ctx->dbgfs))
+			debugfs_create_file("stats", S_IRUSR | S_IRGRP,
+					ctx->dbgfs, ctx,
+					&vtunerc_stats_raw_fops);
+	}
+#endif
+
+	return 0;
+}
+
+void vtunerc_stats_unregister(struct vtunerc_ctx *ctx)
+{
+#ifdef CONFIG_DEBUG_FS
+	if (!IS_ERR_OR_NULL(ctx->dbgfs))
+		debugfs_remove_recursive(ctx->dbgfs);
+	ctx->dbgfs = NULL;
+#endif
+
+#ifdef CONFIG_PROC_FS
+	if (ctx->procname)
+		remove_proc_entry(ctx->procname, NULL);
+	kfree(ctx->procname);
+	ctx->procname = NULL;
+#endif
+}
+
+void vtunerc_stats_init(void)
+{
+#ifdef CONFIG_DEBUG_FS
+	vtunerc_dbgfs_root = debugfs_create_dir("vtunerc", NULL);
+	if (IS_ERR(vtunerc_dbgfs_root))
+		vtunerc_dbgfs_root = NULL;
+#endif
+}
+
+void vtunerc_stats_exit(void)
+{
+#ifdef CONFIG_DEBUG_FS
+	debugfs_remove_recursive(vtunerc_dbgfs_root);
+	vtunerc_dbgfs_root = NULL;
+#endif
+}
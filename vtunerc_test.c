@@ -0,0 +1,313 @@
+/*
+ * vtunerc: KUnit tests
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Covers the parts which need no daemon nor registered adapter: the
+ * PID table and the MSG_PIDLIST made of it, the MSG_SET_FRONTEND
+ * encoding of DVB-S2 parameters, and the trail the write path keeps
+ * for packets crossing a piece boundary. Built as vtunerc_test.ko,
+ * the functions under test are exported by VTUNERC_EXPORT_FOR_TEST.
+ *
+ *   ./tools/testing/kunit/kunit.py run --kunitconfig=<this dir>
+ */
+
+#include <kunit/test.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "vtunerc_priv.h"
+
+static struct vtunerc_ctx *vtunerc_test_ctx(struct kunit *test)
+{
+	struct vtunerc_ctx *ctx;
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ctx);
+	vtunerc_pidtab_reset(ctx);
+
+	return ctx;
+}
+
+/* ------------------------------------------------ */
+/* PID table */
+
+static void vtunerc_test_pidtab_shared(struct kunit *test)
+{
+	struct vtunerc_ctx *ctx = vtunerc_test_ctx(test);
+
+	/* first user adds, the second one only counts */
+	KUNIT_EXPECT_EQ(test, vtunerc_pidtab_get(ctx, 0x100), 1);
+	KUNIT_EXPECT_EQ(test, vtunerc_pidtab_get(ctx, 0x100), 0);
+	KUNIT_EXPECT_EQ(test, ctx->pidtab_len, 1);
+	KUNIT_EXPECT_EQ(test, vtunerc_pidtab_users(ctx, 0x100), 2);
+	KUNIT_EXPECT_TRUE(test, test_bit(0x100, ctx->pidmap));
+
+	/* the PID stays while a user is left */
+	KUNIT_EXPECT_EQ(test, vtunerc_pidtab_put(ctx, 0x100), 0);
+	KUNIT_EXPECT_EQ(test, vtunerc_pidtab_users(ctx, 0x100), 1);
+	KUNIT_EXPECT_TRUE(test, test_bit(0x100, ctx->pidmap));
+
+	KUNIT_EXPECT_EQ(test, vtunerc_pidtab_put(ctx, 0x100), 1);
+	KUNIT_EXPECT_EQ(test, ctx->pidtab_len, 0);
+	KUNIT_EXPECT_EQ(test, vtunerc_pidtab_users(ctx, 0x100), 0);
+	KUNIT_EXPECT_EQ(test, (int)ctx->pidtab[0], PID_UNKNOWN);
+	KUNIT_EXPECT_FALSE(test, test_bit(0x100, ctx->pidmap));
+
+	KUNIT_EXPECT_EQ(test, vtunerc_pidtab_put(ctx, 0x100), -ENOENT);
+}
+
+static void vtunerc_test_pidtab_packed(struct kunit *test)
+{
+	struct vtunerc_ctx *ctx = vtunerc_test_ctx(test);
+
+	vtunerc_pidtab_get(ctx, 0x100);
+	vtunerc_pidtab_get(ctx, 0x200);
+	vtunerc_pidtab_get(ctx, 0x300);
+	vtunerc_pidtab_get(ctx, 0x300);
+
+	/* the last entry fills the hole, with its user count */
+	KUNIT_EXPECT_EQ(test, vtunerc_pidtab_put(ctx, 0x100), 1);
+	KUNIT_EXPECT_EQ(test, ctx->pidtab_len, 2);
+	KUNIT_EXPECT_EQ(test, (int)ctx->pidtab[0], 0x300);
+	KUNIT_EXPECT_EQ(test, (int)ctx->pidtab[1], 0x200);
+	KUNIT_EXPECT_EQ(test, (int)ctx->pidtab[2], PID_UNKNOWN);
+	KUNIT_EXPECT_EQ(test, vtunerc_pidtab_users(ctx, 0x300), 2);
+	KUNIT_EXPECT_EQ(test, vtunerc_pidtab_find(ctx, 0x200), 1);
+}
+
+static void vtunerc_test_pidtab_full(struct kunit *test)
+{
+	struct vtunerc_ctx *ctx = vtunerc_test_ctx(test);
+	int i;
+
+	for (i = 0; i < MAX_PIDTAB_LEN; i++)
+		KUNIT_EXPECT_EQ(test, vtunerc_pidtab_get(ctx, 0x10 + i), 1);
+
+	KUNIT_EXPECT_EQ(test, vtunerc_pidtab_get(ctx, 0x1000), -EBUSY);
+	/* one more user of a listed PID needs no slot */
+	KUNIT_EXPECT_EQ(test, vtunerc_pidtab_get(ctx, 0x10), 0);
+	KUNIT_EXPECT_EQ(test, ctx->pidtab_len, MAX_PIDTAB_LEN);
+}
+
+static void vtunerc_test_pidlist_msg(struct kunit *test)
+{
+	struct vtunerc_ctx *ctx = vtunerc_test_ctx(test);
+	struct vtuner_message msg;
+	int i;
+
+	vtunerc_pidtab_get(ctx, 0x12);
+	vtunerc_pidtab_get(ctx, 0x34);
+	vtunerc_pidtab_get(ctx, 0x34);
+
+	memset(&msg, 0, sizeof(msg));
+	vtunerc_pidtab_to_msg(ctx, &msg);
+
+	KUNIT_EXPECT_EQ(test, msg.type, MSG_PIDLIST);
+	/* shared PIDs are listed once */
+	KUNIT_EXPECT_EQ(test, (int)msg.body.pidlist[0], 0x12);
+	KUNIT_EXPECT_EQ(test, (int)msg.body.pidlist[1], 0x34);
+	for (i = 2; i < MAX_PIDTAB_LEN - 1; i++)
+		KUNIT_EXPECT_EQ(test, (int)msg.body.pidlist[i], PID_UNKNOWN);
+	KUNIT_EXPECT_EQ(test, (int)msg.body.pidlist[MAX_PIDTAB_LEN - 1], 0);
+}
+
+static void vtunerc_test_pidlist_fullts(struct kunit *test)
+{
+	struct vtunerc_ctx *ctx = vtunerc_test_ctx(test);
+	struct vtuner_message msg;
+	int i;
+
+	vtunerc_pidtab_get(ctx, 0x12);
+	vtunerc_pidtab_get(ctx, 0x2000);
+
+	memset(&msg, 0, sizeof(msg));
+	vtunerc_pidtab_to_msg(ctx, &msg);
+
+	/* the full TS feed stands for all the others */
+	KUNIT_EXPECT_EQ(test, msg.type, MSG_PIDLIST);
+	KUNIT_EXPECT_EQ(test, (int)msg.body.pidlist[0], 0x2000);
+	for (i = 1; i < MAX_PIDTAB_LEN - 1; i++)
+		KUNIT_EXPECT_EQ(test, (int)msg.body.pidlist[i], PID_UNKNOWN);
+	KUNIT_EXPECT_EQ(test, (int)msg.body.pidlist[MAX_PIDTAB_LEN - 1], 0);
+
+	/* back to the list when it stops */
+	vtunerc_pidtab_put(ctx, 0x2000);
+	vtunerc_pidtab_to_msg(ctx, &msg);
+	KUNIT_EXPECT_EQ(test, (int)msg.body.pidlist[0], 0x12);
+	KUNIT_EXPECT_EQ(test, (int)msg.body.pidlist[1], PID_UNKNOWN);
+}
+
+/* ------------------------------------------------ */
+/* MSG_SET_FRONTEND */
+
+static void vtunerc_test_fe_s2(struct kunit *test)
+{
+	struct vtunerc_ctx *ctx = vtunerc_test_ctx(test);
+	struct dtv_frontend_properties c;
+	struct vtuner_message msg;
+
+	ctx->vtype = VT_S2;
+	memset(&c, 0, sizeof(c));
+	c.delivery_system = SYS_DVBS2;
+	c.frequency = 1234000;
+	c.symbol_rate = 27500000;
+	c.inversion = INVERSION_OFF;
+	c.modulation = PSK_8;
+	c.fec_inner = FEC_3_4;
+	c.rolloff = ROLLOFF_20;
+	c.pilot = PILOT_ON;
+
+	KUNIT_ASSERT_EQ(test, vtunerc_proxyfe_encode(ctx, &c, &msg), 0);
+	KUNIT_EXPECT_EQ(test, msg.type, MSG_SET_FRONTEND);
+	KUNIT_EXPECT_EQ(test, msg.body.fe_params.frequency, 1234000u);
+	KUNIT_EXPECT_EQ(test, msg.body.fe_params.u.qpsk.symbol_rate, 27500000u);
+	/* S2 base 9, 8PSK another 9, 3/4 is 3 */
+	KUNIT_EXPECT_EQ(test, (int)msg.body.fe_params.u.qpsk.fec_inner, 21);
+	/* rolloff 0.20 in 0x08, pilot on in 0x10 */
+	KUNIT_EXPECT_EQ(test, (int)msg.body.fe_params.inversion, 0x18);
+
+	c.modulation = QPSK;
+	c.fec_inner = FEC_9_10;
+	c.rolloff = ROLLOFF_25;
+	c.pilot = PILOT_AUTO;
+
+	KUNIT_ASSERT_EQ(test, vtunerc_proxyfe_encode(ctx, &c, &msg), 0);
+	KUNIT_EXPECT_EQ(test, (int)msg.body.fe_params.u.qpsk.fec_inner, 18);
+	KUNIT_EXPECT_EQ(test, (int)msg.body.fe_params.inversion, 0x24);
+
+	c.fec_inner = FEC_4_5;
+	c.rolloff = ROLLOFF_35;
+	c.pilot = PILOT_OFF;
+
+	KUNIT_ASSERT_EQ(test, vtunerc_proxyfe_encode(ctx, &c, &msg), 0);
+	KUNIT_EXPECT_EQ(test, (int)msg.body.fe_params.u.qpsk.fec_inner, 17);
+	KUNIT_EXPECT_EQ(test, (int)msg.body.fe_params.inversion, 0);
+}
+
+static void vtunerc_test_fe_s_on_s2(struct kunit *test)
+{
+	struct vtunerc_ctx *ctx = vtunerc_test_ctx(test);
+	struct dtv_frontend_properties c;
+	struct vtuner_message msg;
+
+	/* DVB-S tuned on an S2 frontend goes as it is */
+	ctx->vtype = VT_S2;
+	memset(&c, 0, sizeof(c));
+	c.delivery_system = SYS_DVBS;
+	c.symbol_rate = 22000000;
+	c.inversion = INVERSION_AUTO;
+	c.fec_inner = FEC_5_6;
+	c.rolloff = ROLLOFF_20;
+	c.pilot = PILOT_ON;
+
+	KUNIT_ASSERT_EQ(test, vtunerc_proxyfe_encode(ctx, &c, &msg), 0);
+	KUNIT_EXPECT_EQ(test, (int)msg.body.fe_params.u.qpsk.fec_inner, FEC_5_6);
+	KUNIT_EXPECT_EQ(test, (int)msg.body.fe_params.inversion,
+			INVERSION_AUTO);
+	KUNIT_EXPECT_EQ(test, msg.body.fe_params.u.qpsk.symbol_rate, 22000000u);
+
+	ctx->vtype = VT_NULL;
+	KUNIT_EXPECT_EQ(test, vtunerc_proxyfe_encode(ctx, &c, &msg), -EINVAL);
+}
+
+/* ------------------------------------------------ */
+/* write path trail */
+
+#define VTUNERC_TEST_PKTS	16
+
+/* stands for the demux, collects what it gets */
+struct vtunerc_test_sink {
+	u8 *buf;
+	size_t len;
+	int calls;
+	int bad_len;
+};
+
+static int vtunerc_test_sink_fn(void *arg, const u8 *buf, size_t len)
+{
+	struct vtunerc_test_sink *sink = arg;
+
+	if (len % 188 || sink->len + len > VTUNERC_TEST_PKTS * 188) {
+		sink->bad_len++;
+		return 0;
+	}
+	memcpy(sink->buf + sink->len, buf, len);
+	sink->len += len;
+	sink->calls++;
+
+	return 0;
+}
+
+static void vtunerc_test_trail(struct kunit *test)
+{
+	size_t total = VTUNERC_TEST_PKTS * 188, off, n, i;
+	struct vtunerc_test_sink sink;
+	unsigned int trailsize;
+	u8 *in, *trail;
+	int piece;
+
+	in = kunit_kzalloc(test, total, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, in);
+	sink.buf = kunit_kzalloc(test, total, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, sink.buf);
+	trail = kunit_kzalloc(test, 188, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, trail);
+
+	/* every byte tells its packet and place */
+	for (i = 0; i < total; i++)
+		in[i] = i % 188 ? (i / 188) ^ (i % 188) : 0x47;
+
+	for (piece = 1; piece < 188; piece++) {
+		sink.len = 0;
+		sink.calls = 0;
+		sink.bad_len = 0;
+		trailsize = 0;
+
+		for (off = 0; off < total; off += n) {
+			n = min_t(size_t, piece, total - off);
+			KUNIT_ASSERT_EQ(test, vtunerc_ts_align(trail, &trailsize,
+					in + off, n, vtunerc_test_sink_fn, &sink), 0);
+			/* what is not whole yet waits in the trail */
+			KUNIT_ASSERT_EQ(test, (size_t)trailsize, (off + n) % 188);
+			KUNIT_ASSERT_EQ(test, sink.len, off + n - trailsize);
+		}
+
+		KUNIT_EXPECT_EQ_MSG(test, sink.bad_len, 0, "piece %d", piece);
+		KUNIT_EXPECT_EQ_MSG(test, memcmp(sink.buf, in, total), 0,
+				"piece %d", piece);
+	}
+}
+
+static struct kunit_case vtunerc_test_cases[] = {
+	KUNIT_CASE(vtunerc_test_pidtab_shared),
+	KUNIT_CASE(vtunerc_test_pidtab_packed),
+	KUNIT_CASE(vtunerc_test_pidtab_full),
+	KUNIT_CASE(vtunerc_test_pidlist_msg),
+	KUNIT_CASE(vtunerc_test_pidlist_fullts),
+	KUNIT_CASE(vtunerc_test_fe_s2),
+	KUNIT_CASE(vtunerc_test_fe_s_on_s2),
+	KUNIT_CASE(vtunerc_test_trail),
+	{}
+};
+
+static struct kunit_suite vtunerc_test_suite = {
+	.name = "vtunerc",
+	.test_cases = vtunerc_test_cases,
+};
+
+kunit_test_suite(vtunerc_test_suite);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("vtunerc KUnit tests");
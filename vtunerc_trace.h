@@ -0,0 +1,170 @@
+/*
+ * vtunerc: tracepoints
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM vtunerc
+
+#if !defined(_VTUNERC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _VTUNERC_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* control message life: queued, picked up by the daemon, answered */
+DECLARE_EVENT_CLASS(vtunerc_msg,
+
+	TP_PROTO(int idx, int type, u32 seq),
+
+	TP_ARGS(idx, type, seq),
+
+	TP_STRUCT__entry(
+		__field(int, idx)
+		__field(int, type)
+		__field(u32, seq)
+	),
+
+	TP_fast_assign(
+		__entry->idx = idx;
+		__entry->type = type;
+		__entry->seq = seq;
+	),
+
+	TP_printk("vtunerc%d type=%d seq=%u",
+		__entry->idx, __entry->type, __entry->seq)
+);
+
+DEFINE_EVENT(vtunerc_msg, vtunerc_msg_queue,
+	TP_PROTO(int idx, int type, u32 seq),
+	TP_ARGS(idx, type, seq)
+);
+
+DEFINE_EVENT(vtunerc_msg, vtunerc_msg_pickup,
+	TP_PROTO(int idx, int type, u32 seq),
+	TP_ARGS(idx, type, seq)
+);
+
+DEFINE_EVENT(vtunerc_msg, vtunerc_msg_response,
+	TP_PROTO(int idx, int type, u32 seq),
+	TP_ARGS(idx, type, seq)
+);
+
+DECLARE_EVENT_CLASS(vtunerc_feed,
+
+	TP_PROTO(int idx, u16 pid, int type, int users),
+
+	TP_ARGS(idx, pid, type, users),
+
+	TP_STRUCT__entry(
+		__field(int, idx)
+		__field(u16, pid)
+		__field(int, type)
+		__field(int, users)
+	),
+
+	TP_fast_assign(
+		__entry->idx = idx;
+		__entry->pid = pid;
+		__entry->type = type;
+		__entry->users = users;
+	),
+
+	TP_printk("vtunerc%d pid=0x%x type=%d users=%d",
+		__entry->idx, __entry->pid, __entry->type, __entry->users)
+);
+
+DEFINE_EVENT(vtunerc_feed, vtunerc_start_feed,
+	TP_PROTO(int idx, u16 pid, int type, int users),
+	TP_ARGS(idx, pid, type, users)
+);
+
+DEFINE_EVENT(vtunerc_feed, vtunerc_stop_feed,
+	TP_PROTO(int idx, u16 pid, int type, int users),
+	TP_ARGS(idx, pid, type, users)
+);
+
+/* proxy frontend op, start and end give its latency */
+TRACE_EVENT(vtunerc_fe_op_start,
+
+	TP_PROTO(int idx, int type),
+
+	TP_ARGS(idx, type),
+
+	TP_STRUCT__entry(
+		__field(int, idx)
+		__field(int, type)
+	),
+
+	TP_fast_assign(
+		__entry->idx = idx;
+		__entry->type = type;
+	),
+
+	TP_printk("vtunerc%d type=%d", __entry->idx, __entry->type)
+);
+
+TRACE_EVENT(vtunerc_fe_op_end,
+
+	TP_PROTO(int idx, int type, int ret),
+
+	TP_ARGS(idx, type, ret),
+
+	TP_STRUCT__entry(
+		__field(int, idx)
+		__field(int, type)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->idx = idx;
+		__entry->type = type;
+		__entry->ret = ret;
+	),
+
+	TP_printk("vtunerc%d type=%d ret=%d",
+		__entry->idx, __entry->type, __entry->ret)
+);
+
+/* one batch of injected packets handed to the demux */
+TRACE_EVENT(vtunerc_ts_batch,
+
+	TP_PROTO(int idx, size_t bytes, unsigned int packets,
+		unsigned int drops),
+
+	TP_ARGS(idx, bytes, packets, drops),
+
+	TP_STRUCT__entry(
+		__field(int, idx)
+		__field(size_t, bytes)
+		__field(unsigned int, packets)
+		__field(unsigned int, drops)
+	),
+
+	TP_fast_assign(
+		__entry->idx = idx;
+		__entry->bytes = bytes;
+		__entry->packets = packets;
+		__entry->drops = drops;
+	),
+
+	TP_printk("vtunerc%d bytes=%zu packets=%u drops=%u",
+		__entry->idx, __entry->bytes, __entry->packets,
+		__entry->drops)
+);
+
+#endif /* _VTUNERC_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE vtunerc_trace
+
+#include <trace/define_trace.h>
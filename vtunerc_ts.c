@@ -0,0 +1,132 @@
+/*
+ * vtunerc: TS packet validation and alignment
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Per packet code of the write path. It knows nothing of the driver
+ * context, so tools/ can build it against tools/shim for fuzzing and
+ * benchmarking outside the kernel.
+ */
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+
+#include "vtunerc_ts.h"
+
+/*
+ * sync byte and TEI of the whole batch, four packets per step
+ * without branches; nonzero when some packet needs a closer look
+ */
+u8 vtunerc_ts_batch_bad(const u8 *buf, size_t count)
+{
+	u8 bad = 0;
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4, buf += 4 * 188)
+		bad |= (buf[0] ^ 0x47) | (buf[188] ^ 0x47) |
+			(buf[376] ^ 0x47) | (buf[564] ^ 0x47) |
+			((buf[1] | buf[189] | buf[377] | buf[565]) & 0x80);
+
+	for (; i < count; i++, buf += 188)
+		bad |= (buf[0] ^ 0x47) | (buf[1] & 0x80);
+
+	return bad;
+}
+
+/*
+ * per packet validation, returns 0 when the packet has to be dropped;
+ * suspect says the batch failed vtunerc_ts_batch_bad()
+ */
+int vtunerc_ts_check(struct vtunerc_pidstat *pidstat, const u8 *p,
+			int suspect, struct vtunerc_ts_stats *st)
+{
+	unsigned int pid = ((p[1] & 0x1f) << 8) | p[2];
+	struct vtunerc_pidstat *ps = &pidstat[pid];
+	u8 cc = p[3] & 0x0f;
+
+	if (suspect) {
+		if (p[0] != 0x47) {
+			st->drop_sync++;
+			return 0;
+		}
+		if (p[1] & 0x80) {
+			st->drop_tei++;
+			ps->tei_errors++;
+			return 0;
+		}
+	}
+
+	/* continuity counter only increments with payload */
+	if (pid == 0x1fff || !(p[3] & 0x10))
+		return 1;
+
+	if (ps->cc_valid && cc != ((ps->cc + 1) & 0x0f) && cc != ps->cc &&
+			!((p[3] & 0x20) && p[4] && (p[5] & 0x80))) {
+		ps->cc_errors++;
+		st->cc_errors++;
+	}
+	ps->cc = cc;
+	ps->cc_valid = 1;
+
+	return 1;
+}
+
+/*
+ * turn count 192 byte (time stamp first) or 204 byte (parity last)
+ * packets into 188 byte ones, in place
+ */
+void vtunerc_ts_strip(u8 *buf, size_t count, unsigned int pktsize)
+{
+	const u8 *src = buf + (pktsize == 192 ? 4 : 0);
+	size_t i;
+
+	for (i = 0; i < count; i++, buf += 188, src += pktsize)
+		memmove(buf, src, 188);
+}
+
+/*
+ * pass the whole packets of buf to fn, a packet crossing the end of
+ * buf is assembled in trail (*trailsize bytes kept between calls)
+ */
+int vtunerc_ts_align(u8 *trail, unsigned int *trailsize, const u8 *buf,
+			size_t len, vtunerc_ts_fn fn, void *arg)
+{
+	size_t n;
+	int ret;
+
+	if (*trailsize) {
+		n = min_t(size_t, len, 188 - *trailsize);
+		memcpy(trail + *trailsize, buf, n);
+		*trailsize += n;
+		buf += n;
+		len -= n;
+		if (*trailsize < 188)
+			return 0;
+		*trailsize = 0;
+		ret = fn(arg, trail, 188);
+		if (ret)
+			return ret;
+	}
+
+	n = len - len % 188;
+	if (n) {
+		ret = fn(arg, buf, n);
+		if (ret)
+			return ret;
+	}
+
+	memcpy(trail, buf + n, len - n);
+	*trailsize = len - n;
+
+	return 0;
+}
+VTUNERC_EXPORT_FOR_TEST(vtunerc_ts_align);
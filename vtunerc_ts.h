@@ -0,0 +1,65 @@
+/*
+ * vtunerc: TS packet validation and alignment
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _VTUNERC_TS_H
+#define _VTUNERC_TS_H
+
+#include <linux/kernel.h>
+
+/*
+ * internals the KUnit suite in vtunerc_test.ko calls; spelled out
+ * instead of IS_ENABLED() so the tools/shim build needs nothing more
+ */
+#if defined(CONFIG_DVB_VTUNERC_KUNIT_TEST) || \
+	defined(CONFIG_DVB_VTUNERC_KUNIT_TEST_MODULE)
+#include <linux/export.h>
+#define VTUNERC_EXPORT_FOR_TEST(sym)	EXPORT_SYMBOL_GPL(sym)
+#else
+#define VTUNERC_EXPORT_FOR_TEST(sym)
+#endif
+
+/* per PID ingest state */
+struct vtunerc_pidstat {
+	u8 cc;
+	u8 cc_valid;
+	u8 active;		/* listed in ratepid[] */
+	u32 cc_errors;
+	u32 tei_errors;
+	u64 packets;
+	u64 last_packets;	/* at the last rate update */
+	u64 rate;		/* bit/s, moving average */
+};
+
+/* ingest counters, updated under tswrite_sem */
+struct vtunerc_ts_stats {
+	u64 wr_calls;
+	u64 wr_bytes;
+	u64 drop_null;
+	u64 drop_pid;
+	u64 drop_sync;
+	u64 drop_tei;
+	u64 drop_short;		/* datagrams not carrying whole packets */
+	u64 cc_errors;
+};
+
+/* gets whole packets, len is a multiple of 188 */
+typedef int (*vtunerc_ts_fn)(void *arg, const u8 *buf, size_t len);
+
+u8 vtunerc_ts_batch_bad(const u8 *buf, size_t count);
+int vtunerc_ts_check(struct vtunerc_pidstat *pidstat, const u8 *p,
+			int suspect, struct vtunerc_ts_stats *st);
+void vtunerc_ts_strip(u8 *buf, size_t count, unsigned int pktsize);
+int vtunerc_ts_align(u8 *trail, unsigned int *trailsize, const u8 *buf,
+			size_t len, vtunerc_ts_fn fn, void *arg);
+
+#endif